@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SG2VG_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "bases.h"
+
+using namespace std;
+
+static const char* IUPACBases = "ACGTURYSWKMBDHVN";
+
+/** upper case version of every valid base (in either case), and 0 for
+ * everything else */
+struct BaseTable
+{
+   BaseTable()
+   {
+     memset(upper, 0, sizeof(upper));
+     for (const char* b = IUPACBases; *b != '\0'; ++b)
+     {
+       upper[(unsigned char)*b] = *b;
+       upper[(unsigned char)*b + 'a' - 'A'] = *b;
+     }
+   }
+   char upper[256];
+};
+
+size_t normalizeBasesScalar(char* bases, size_t length, bool upperCase)
+{
+  static const BaseTable table;
+  for (size_t i = 0; i < length; ++i)
+  {
+    char upper = table.upper[(unsigned char)bases[i]];
+    if (upper == 0)
+    {
+      return i;
+    }
+    if (upperCase)
+    {
+      bases[i] = upper;
+    }
+  }
+  return length;
+}
+
+#ifdef SG2VG_X86_KERNELS
+
+// the vector versions work on the characters with the lower case bit
+// cleared, which only leaves letters in the range A-Z.  the letters
+// that aren't IUPAC codes are then ruled out one by one.
+
+static size_t normalizeBasesSSE2(char* bases, size_t length, bool upperCase)
+{
+  const __m128i caseMask = _mm_set1_epi8((char)~0x20);
+  const __m128i first = _mm_set1_epi8('A');
+  const __m128i range = _mm_set1_epi8('Z' - 'A');
+  const __m128i e = _mm_set1_epi8('E'), f = _mm_set1_epi8('F');
+  const __m128i i_ = _mm_set1_epi8('I'), j = _mm_set1_epi8('J');
+  const __m128i l = _mm_set1_epi8('L'), o = _mm_set1_epi8('O');
+  const __m128i p = _mm_set1_epi8('P'), q = _mm_set1_epi8('Q');
+  const __m128i x = _mm_set1_epi8('X'), z = _mm_set1_epi8('Z');
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i c = _mm_loadu_si128((const __m128i*)(bases + i));
+    __m128i u = _mm_and_si128(c, caseMask);
+    __m128i offset = _mm_sub_epi8(u, first);
+    __m128i letter = _mm_cmpeq_epi8(_mm_min_epu8(offset, range), offset);
+    __m128i bad = _mm_or_si128(
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(u, e), _mm_cmpeq_epi8(u, f)),
+                   _mm_or_si128(_mm_cmpeq_epi8(u, i_), _mm_cmpeq_epi8(u, j))),
+      _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(u, l), _mm_cmpeq_epi8(u, o)),
+                     _mm_or_si128(_mm_cmpeq_epi8(u, p), _mm_cmpeq_epi8(u, q))),
+        _mm_or_si128(_mm_cmpeq_epi8(u, x), _mm_cmpeq_epi8(u, z))));
+    if (_mm_movemask_epi8(_mm_andnot_si128(bad, letter)) != 0xFFFF)
+    {
+      // let the scalar version find exactly where
+      break;
+    }
+    if (upperCase)
+    {
+      _mm_storeu_si128((__m128i*)(bases + i), u);
+    }
+  }
+  return i + normalizeBasesScalar(bases + i, length - i, upperCase);
+}
+
+__attribute__((target("avx2")))
+static size_t normalizeBasesAVX2(char* bases, size_t length, bool upperCase)
+{
+  const __m256i caseMask = _mm256_set1_epi8((char)~0x20);
+  const __m256i first = _mm256_set1_epi8('A');
+  const __m256i range = _mm256_set1_epi8('Z' - 'A');
+  const __m256i e = _mm256_set1_epi8('E'), f = _mm256_set1_epi8('F');
+  const __m256i i_ = _mm256_set1_epi8('I'), j = _mm256_set1_epi8('J');
+  const __m256i l = _mm256_set1_epi8('L'), o = _mm256_set1_epi8('O');
+  const __m256i p = _mm256_set1_epi8('P'), q = _mm256_set1_epi8('Q');
+  const __m256i x = _mm256_set1_epi8('X'), z = _mm256_set1_epi8('Z');
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32)
+  {
+    __m256i c = _mm256_loadu_si256((const __m256i*)(bases + i));
+    __m256i u = _mm256_and_si256(c, caseMask);
+    __m256i offset = _mm256_sub_epi8(u, first);
+    __m256i letter = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, range),
+                                       offset);
+    __m256i bad = _mm256_or_si256(
+      _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(u, e), _mm256_cmpeq_epi8(u, f)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(u, i_), _mm256_cmpeq_epi8(u, j))),
+      _mm256_or_si256(
+        _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(u, l), _mm256_cmpeq_epi8(u, o)),
+          _mm256_or_si256(_mm256_cmpeq_epi8(u, p), _mm256_cmpeq_epi8(u, q))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(u, x), _mm256_cmpeq_epi8(u, z))));
+    if (_mm256_movemask_epi8(_mm256_andnot_si256(bad, letter)) != -1)
+    {
+      break;
+    }
+    if (upperCase)
+    {
+      _mm256_storeu_si256((__m256i*)(bases + i), u);
+    }
+  }
+  // (the tail is short enough to not bother with SSE2)
+  return i + normalizeBasesScalar(bases + i, length - i, upperCase);
+}
+
+#endif
+
+typedef size_t (*BasesKernel)(char*, size_t, bool);
+
+struct KernelChoice
+{
+   KernelChoice() : kernel(normalizeBasesScalar), name("scalar")
+   {
+#ifdef SG2VG_X86_KERNELS
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("avx2"))
+     {
+       kernel = normalizeBasesAVX2;
+       name = "avx2";
+     }
+     else
+     {
+       // (every x86-64 cpu has SSE2)
+       kernel = normalizeBasesSSE2;
+       name = "sse2";
+     }
+#endif
+   }
+   BasesKernel kernel;
+   const char* name;
+};
+
+static const KernelChoice& getKernelChoice()
+{
+  static const KernelChoice choice;
+  return choice;
+}
+
+size_t normalizeBases(char* bases, size_t length, bool upperCase)
+{
+  return getKernelChoice().kernel(bases, length, upperCase);
+}
+
+const char* getBasesKernelName()
+{
+  return getKernelChoice().name;
+}
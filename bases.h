@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#ifndef _BASES_H
+#define _BASES_H
+
+#include <cstddef>
+
+/**
+Checking (and upper-casing) the bases of downloaded sequences, which
+can add up to billions of characters, so it's done as they're parsed
+with SSE2 or AVX2 (picked at run time by what the CPU supports) on
+x86-64, and a lookup table everywhere else.
+
+Valid bases are the IUPAC nucleotide codes ACGTURYSWKMBDHVN, in either
+case.
+*/
+
+/** Check bases, upper-casing them as we go if upperCase.  returns the
+ * position of the first invalid base (before which everything has been
+ * upper-cased), or length if they're all valid */
+size_t normalizeBases(char* bases, size_t length, bool upperCase);
+
+/** Same thing one character at a time, for comparison */
+size_t normalizeBasesScalar(char* bases, size_t length, bool upperCase);
+
+/** Name of the version normalizeBases() uses on this CPU ("avx2", "sse2"
+ * or "scalar") */
+const char* getBasesKernelName();
+
+#endif
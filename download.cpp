@@ -8,23 +8,181 @@
 #include <cstdlib>
 #include <curl/curl.h>
 #include <cstring>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <cmath>
 
 #include "download.h"
 
 using namespace std;
+using namespace std::chrono;
 
 // this code is mostly derived from libucrl example
 // http://curl.haxx.se/libcurl/c/getinmemory.html
 
-Download::Download()
+const int Download::DefaultMaxInFlight = 8;
+const int Download::DefaultMaxRetries = 5;
+const double Download::DefaultRetryDelay = 0.5;
+
+// longest we'll ever wait before retrying a request (not counting jitter)
+static const double MaxRetryDelay = 30.;
+
+/** Is a request that finished with result and httpCode worth trying 
+ * again? */
+static bool isTransient(CURLcode result, long httpCode)
 {
-  _buffer.memory = NULL;
-  clearBuffer();
+  switch (result)
+  {
+  case CURLE_OK:
+    return httpCode == 408 || httpCode == 429 || httpCode == 500 ||
+       httpCode == 502 || httpCode == 503 || httpCode == 504;
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_HTTP2:
+  case CURLE_HTTP2_STREAM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+const size_t ResponseStream::ChunkSize = 64 * 1024;
+
+size_t Download::writeCallback(void *contents, size_t size, size_t nmemb,
+                               void *userp)
+{
+  size_t realsize = size * nmemb;
+  Request* request = (Request *)userp;
+  MemoryStruct& mem = request->buffer;
+
+  // read() can look at the buffer while we're still appending to it
+  lock_guard<mutex> lock(request->download->_mutex);
+  
+  if (mem.size == 0)
+  {
+    /* first chunk: make room for everything if we know how big it is.
+       (if the response is compressed, this is only a lower bound) */
+    curl_off_t length = -1;
+    curl_easy_getinfo(request->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &length);
+    if (length > 0)
+    {
+      reserveBuffer(mem, (size_t)length + 1);
+    }
+    /* the headers are in, so we know if this is a response worth 
+       handing out before it's done */
+    long httpCode = 0;
+    curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE, &httpCode);
+    request->streamable = httpCode == 200;
+  }
+ 
+  if (appendToBuffer(mem, (const char*)contents, realsize) == false) {
+    /* out of memory! */ 
+    printf("not enough memory (realloc returned NULL)\n");
+    return 0;
+  }
+
+  if (request->streamed)
+  {
+    request->download->_finished.notify_all();
+  }
+  return realsize;
+}
+
+bool Download::appendToBuffer(MemoryStruct& buffer, const char* data,
+                              size_t length)
+{
+  if (buffer.size + length + 1 > buffer.capacity &&
+      reserveBuffer(buffer, max(buffer.size + length + 1,
+                                2 * buffer.capacity)) == false)
+  {
+    return false;
+  }
+  memcpy(buffer.memory + buffer.size, data, length);
+  buffer.size += length;
+  buffer.memory[buffer.size] = '\0';
+  return true;
+}
+
+bool Download::reserveBuffer(MemoryStruct& buffer, size_t capacity)
+{
+  if (capacity <= buffer.capacity)
+  {
+    return true;
+  }
+  char* memory = (char*)realloc(buffer.memory, capacity);
+  if (memory == NULL)
+  {
+    return false;
+  }
+  buffer.memory = memory;
+  buffer.capacity = capacity;
+  return true;
+}
+
+Download::Download() : _inFlight(0), _maxInFlight(0),
+                       _requestCount(0), _connectionCount(0),
+                       _bytesReceived(0), _bytesDecoded(0),
+                       _compression(true),
+                       _maxRetries(DefaultMaxRetries),
+                       _retryDelay(DefaultRetryDelay), _stallTimeout(0),
+                       _retryCount(0),
+                       _random(random_device()()),
+                       _transport(Live), _replayLatency(0),
+                       _replayBandwidth(0), _stats(NULL),
+                       _background(false), _stopping(false)
+{
+  _buffer = takeBuffer();
+
+  _multi = curl_multi_init();
+  if (_multi == NULL)
+  {
+    throw runtime_error("curl_multi_init() failed");
+  }
+  // use HTTP/2 multiplexing if the server supports it
+  curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  setMaxInFlight(DefaultMaxInFlight);
+  
+  // DNS lookups, TLS sessions and open connections get cached here
+  // and reused by every request made through this object
+  _share = curl_share_init();
+  if (_share == NULL)
+  {
+    // (the destructor won't run)
+    curl_multi_cleanup(_multi);
+    free(_buffer.memory);
+    throw runtime_error("curl_share_init() failed");
+  }
+  curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
 }
 
 Download::~Download()
 {
+  setBackground(false);
+  while (!_requests.empty())
+  {
+    release(*_requests.begin());
+  }
+  for (int i = 0; i < _idleHandles.size(); ++i)
+  {
+    curl_easy_cleanup(_idleHandles[i]);
+  }
+  curl_multi_cleanup(_multi);
+  curl_share_cleanup(_share);
   free(_buffer.memory);
+  for (int i = 0; i < _freeBuffers.size(); ++i)
+  {
+    free(_freeBuffers[i].memory);
+  }
 }
 
 void Download::init()
@@ -39,139 +197,915 @@ void Download::cleanup()
 
 void Download::clearBuffer()
 {
-  free(_buffer.memory);
-  _buffer.memory = (char*)malloc(1);
+  // keep the memory around for the next request
+  _buffer.memory[0] = '\0';
   _buffer.size = 0;
 }
 
-static size_t
-WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+const char* Download::postRequest(const string& url,
+                                  const vector<string>& headers,
+                                  const string& postData)
 {
-  size_t realsize = size * nmemb;
-  Download::MemoryStruct* mem = (Download::MemoryStruct *)userp;
- 
-  mem->memory = (char*)realloc(mem->memory, mem->size + realsize + 1);
-  if(mem->memory == NULL) {
-    /* out of memory! */ 
-    printf("not enough memory (realloc returned NULL)\n");
-    return 0;
+  clearBuffer();
+  Request* request = submitPost(url, headers, postData);
+  try
+  {
+    wait(request);
   }
+  catch (...)
+  {
+    release(request);
+    throw;
+  }
+  swap(_buffer, request->buffer);
+  release(request);
+  return getBuffer();
+}
 
-  memcpy(&(mem->memory[mem->size]), contents, realsize);
-  mem->size += realsize;
-  mem->memory[mem->size] = '\0';
+const char* Download::getRequest(const string& url,
+                                 const vector<string>& headers)
+{
+  clearBuffer();
+  Request* request = submitGet(url, headers);
+  try
+  {
+    wait(request);
+  }
+  catch (...)
+  {
+    release(request);
+    throw;
+  }
+  swap(_buffer, request->buffer);
+  release(request);
+  return getBuffer();
+}
 
-  return realsize;
+const char* Download::getBuffer()
+{
+  assert(_buffer.memory[_buffer.size] == '\0');
+  return _buffer.memory;
 }
 
-const char* Download::postRequest(const string& url,
-                                  const vector<string>& headers,
-                                  const string& postData)
+Download::Request* Download::submitPost(const string& url,
+                                        const vector<string>& headers,
+                                        const string& postData)
 {
-  clearBuffer();
-  
-  CURL *curl_handle;
-  CURLcode res;
-  curl_handle = curl_easy_init();
-  
-  /* specify URL to get */
-  curl_easy_setopt(curl_handle, CURLOPT_URL, url.c_str());
+  return submit(url, headers, postData, true);
+}
 
-  /* Now specify we want to POST data */ 
-  curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
+Download::Request* Download::submitGet(const string& url,
+                                       const vector<string>& headers)
+{
+  return submit(url, headers, string(), false);
+}
 
-  /* headers */
-  struct curl_slist* curlHeaders = NULL;
-  curl_slist_append(curlHeaders, "Transfer-Encoding: chunked");
-  for (int i = 0; i < headers.size(); ++i)
+Download::Request* Download::submit(const string& url,
+                                    const vector<string>& headers,
+                                    const string& postData,
+                                    bool post)
+{
+  // read the cache before taking _mutex, so that the I/O thread (and
+  // everyone else) isn't held up while the entry comes off the disk.
+  // (recording and replaying must see every request)
+  string cached;
+  bool cacheHit = false;
+  {
+    lock_guard<mutex> cacheLock(_cacheMutex);
+    cacheHit = _cache.isOpen() && _transport == Live &&
+       _cache.load(url, postData, cached) == true;
+  }
+
+  lock_guard<mutex> lock(_mutex);
+  Request* request = new Request();
+  request->url = url;
+  request->headers = headers;
+  request->postData = postData;
+  request->post = post;
+  request->buffer = takeBuffer();
+  request->done = false;
+  request->httpCode = 0;
+  request->handle = NULL;
+  request->curlHeaders = NULL;
+  request->retries = 0;
+  request->startTime = 0.;
+  request->seconds = -1.;
+  request->streamable = false;
+  request->streamed = false;
+  request->download = this;
+  _requests.insert(request);
+
+  if (cacheHit)
   {
-    curlHeaders = curl_slist_append(curlHeaders, headers[i].c_str());
+    if (appendToBuffer(request->buffer, cached.data(),
+                       cached.length()) == false)
+    {
+      request->error = "not enough memory for cached response";
+    }
+    request->httpCode = 200;
+    request->done = true;
+    if (_stats != NULL)
+    {
+      _stats->addCacheHit(url, post);
+    }
+    return request;
   }
-  curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, curlHeaders);
   
-  /* send all data to this function  */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
- 
-  /* we pass our 'chunk' struct to the callback function */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&_buffer);
+  _queued.push_back(request);
+  if (_background)
+  {
+    curl_multi_wakeup(_multi);
+  }
+  return request;
+}
 
-  curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, postData.c_str());
+const char* Download::wait(Request* request)
+{
+  unique_lock<mutex> lock(_mutex);
+  assert(_requests.find(request) != _requests.end());
+  while (!request->done)
+  {
+    if (_background)
+    {
+      _finished.wait(lock);
+    }
+    else
+    {
+      step(lock);
+    }
+  }
+  if (!request->error.empty())
+  {
+    throw TransferError(string("curl_easy_perform() failed: ") +
+                        request->error);
+  }
+  assert(request->buffer.memory[request->buffer.size] == '\0');
+  return request->buffer.memory;
+}
 
-#ifdef CURL_VERBOSE
-  curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
-#else
-  curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 0L);
-#endif
+void Download::waitAll()
+{
+  unique_lock<mutex> lock(_mutex);
+  while (!_queued.empty() || _inFlight > 0 || !_retrying.empty())
+  {
+    if (_background)
+    {
+      _finished.wait(lock);
+    }
+    else
+    {
+      step(lock);
+    }
+  }
+}
+
+long Download::read(Request* request, int& attempt, size_t offset,
+                    char* out, size_t length)
+{
+  unique_lock<mutex> lock(_mutex);
+  assert(_requests.find(request) != _requests.end());
+  request->streamed = true;
+  while (true)
+  {
+    if ((request->done && !request->error.empty()) ||
+        (attempt >= 0 && attempt != request->retries))
+    {
+      request->streamed = false;
+      return -1;
+    }
+    if (request->done ||
+        (request->streamable && request->buffer.size > offset))
+    {
+      attempt = request->retries;
+      size_t count = 0;
+      if (offset < request->buffer.size)
+      {
+        count = min(length, request->buffer.size - offset);
+        memcpy(out, request->buffer.memory + offset, count);
+      }
+      request->streamed = false;
+      return count;
+    }
+    if (_background)
+    {
+      _finished.wait(lock);
+    }
+    else
+    {
+      step(lock);
+    }
+  }
+}
 
-  res = curl_easy_perform(curl_handle);
+bool Download::isDone(Request* request)
+{
+  lock_guard<mutex> lock(_mutex);
+  return request->done;
+}
 
-  /* Check for errors */ 
-  if(res != CURLE_OK)
+void Download::release(Request* request)
+{
+  lock_guard<mutex> lock(_mutex);
+  if (request->handle != NULL && _background)
   {
-    throw runtime_error(string("curl_easy_perform() failed: ") +
-                        curl_easy_strerror(res));
+    // still running, but only the I/O thread can touch the multi handle
+    _requests.erase(request);
+    _cancelled.push_back(request);
+    curl_multi_wakeup(_multi);
+    return;
   }
-  
-  curl_slist_free_all(curlHeaders);
-  curl_easy_cleanup(curl_handle);
+  else if (request->handle != NULL)
+  {
+    // still running: cancel it
+    detach(request);
+  }
+  else if (!request->done)
+  {
+    deque<Request*>::iterator i = find(_queued.begin(), _queued.end(),
+                                       request);
+    if (i != _queued.end())
+    {
+      _queued.erase(i);
+    }
+    vector<Request*>::iterator j = find(_retrying.begin(), _retrying.end(),
+                                        request);
+    if (j != _retrying.end())
+    {
+      _retrying.erase(j);
+    }
+    j = find(_replaying.begin(), _replaying.end(), request);
+    if (j != _replaying.end())
+    {
+      _replaying.erase(j);
+      --_inFlight;
+    }
+  }
+  _requests.erase(request);
+  destroy(request);
+}
 
-  return getBuffer();
+void Download::destroy(Request* request)
+{
+  assert(request->handle == NULL);
+  recycleBuffer(request->buffer);
+  delete request;
 }
 
-const char* Download::getRequest(const string& url,
-                                 const vector<string>& headers)
+Download::MemoryStruct Download::takeBuffer()
 {
-  clearBuffer();
-  
-  CURL *curl_handle;
-  CURLcode res;
-  curl_handle = curl_easy_init();
-  
-  /* specify URL to get */
-  curl_easy_setopt(curl_handle, CURLOPT_URL, url.c_str());
+  MemoryStruct buffer;
+  if (!_freeBuffers.empty())
+  {
+    buffer = _freeBuffers.back();
+    _freeBuffers.pop_back();
+  }
+  else
+  {
+    buffer.memory = (char*)malloc(1);
+    buffer.capacity = 1;
+  }
+  buffer.memory[0] = '\0';
+  buffer.size = 0;
+  return buffer;
+}
 
-  /* Now specify we want to GET data */ 
-  curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1L);
+void Download::recycleBuffer(MemoryStruct& buffer)
+{
+  // enough for every running request plus the pages waiting to be parsed
+  if (_freeBuffers.size() < 2 * _maxInFlight)
+  {
+    _freeBuffers.push_back(buffer);
+  }
+  else
+  {
+    free(buffer.memory);
+  }
+  buffer.memory = NULL;
+  buffer.size = 0;
+  buffer.capacity = 0;
+}
 
-  /* headers */
-  struct curl_slist* curlHeaders = NULL;
-  curl_slist_append(curlHeaders, "Transfer-Encoding: chunked");
-  for (int i = 0; i < headers.size(); ++i)
+void Download::setMaxInFlight(int maxInFlight)
+{
+  // only the I/O thread can touch the multi handle, so stop it
+  bool background = _background;
+  setBackground(false);
+  _maxInFlight = max(1, maxInFlight);
+  curl_multi_setopt(_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                    (long)_maxInFlight);
+  setBackground(background);
+}
+
+void Download::setBackground(bool background)
+{
+  if (background == _background)
   {
-    curlHeaders = curl_slist_append(curlHeaders, headers[i].c_str());
+    return;
   }
-  curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, curlHeaders);
+  if (background == true)
+  {
+    _stopping = false;
+    _background = true;
+    _ioThread = thread(&Download::ioLoop, this);
+  }
+  else
+  {
+    {
+      lock_guard<mutex> lock(_mutex);
+      _stopping = true;
+    }
+    curl_multi_wakeup(_multi);
+    _ioThread.join();
+    _background = false;
+  }
+}
+
+void Download::setMaxRetries(int maxRetries)
+{
+  lock_guard<mutex> lock(_mutex);
+  _maxRetries = max(0, maxRetries);
+}
+
+void Download::setRetryDelay(double seconds)
+{
+  lock_guard<mutex> lock(_mutex);
+  _retryDelay = max(0., seconds);
+}
+
+void Download::setStallTimeout(long seconds)
+{
+  lock_guard<mutex> lock(_mutex);
+  _stallTimeout = max(0L, seconds);
+}
+
+void Download::setCacheDir(const string& directory, size_t maxBytes)
+{
+  lock_guard<mutex> lock(_mutex);
+  lock_guard<mutex> cacheLock(_cacheMutex);
+  if (directory.empty())
+  {
+    _cache.close();
+  }
+  else
+  {
+    _cache.open(directory, maxBytes);
+  }
+}
+
+void Download::setTransport(Transport transport, const string& archiveDir)
+{
+  lock_guard<mutex> lock(_mutex);
+  lock_guard<mutex> cacheLock(_cacheMutex);
+  _archive.close();
+  if (transport != Live)
+  {
+    // archive is never evicted from
+    _archive.open(archiveDir, numeric_limits<size_t>::max());
+  }
+  _transport = transport;
+}
+
+void Download::setReplaySpeed(double latency, double bandwidth)
+{
+  lock_guard<mutex> lock(_mutex);
+  _replayLatency = max(0., latency);
+  _replayBandwidth = max(0., bandwidth);
+}
+
+void Download::setStats(RunStats* stats)
+{
+  lock_guard<mutex> lock(_mutex);
+  _stats = stats;
+}
+
+void Download::setCompression(bool compression)
+{
+  lock_guard<mutex> lock(_mutex);
+  _compression = compression;
+}
+
+void Download::ioLoop()
+{
+  unique_lock<mutex> lock(_mutex);
+  while (true)
+  {
+    for (int i = 0; i < _cancelled.size(); ++i)
+    {
+      // it may have finished (or failed and been set to retry) since it
+      // was released
+      Request* request = _cancelled[i];
+      if (request->handle != NULL)
+      {
+        detach(request);
+      }
+      vector<Request*>::iterator j = find(_retrying.begin(), _retrying.end(),
+                                          request);
+      if (j != _retrying.end())
+      {
+        _retrying.erase(j);
+      }
+      destroy(request);
+    }
+    _cancelled.clear();
+    
+    if (_stopping)
+    {
+      break;
+    }
+    
+    queueRetries();
+    startQueued();
+
+    // the transfers themselves only touch curl and the buffers of running
+    // requests (and the write callback locks for those)
+    lock.unlock();
+    int running = 0;
+    CURLMcode mres = curl_multi_perform(_multi, &running);
+    lock.lock();
+
+    if (mres != CURLM_OK)
+    {
+      // no way to throw from here, so fail everything that's running
+      for (set<Request*>::iterator i = _requests.begin();
+           i != _requests.end(); ++i)
+      {
+        if ((*i)->handle != NULL)
+        {
+          (*i)->error = curl_multi_strerror(mres);
+          detach(*i);
+          (*i)->done = true;
+        }
+      }
+    }
+    finishTransfers();
+    finishReplays();
+    _finished.notify_all();
+    writeStores(lock);
+
+    int timeout = getWaitTimeout();
+    lock.unlock();
+    int numfds = 0;
+    curl_multi_poll(_multi, NULL, 0, timeout, &numfds);
+    lock.lock();
+  }
+}
+
+void Download::step(unique_lock<mutex>& lock)
+{
+  queueRetries();
+  startQueued();
+
+  int running = 0;
+  lock.unlock();
+  CURLMcode mres = curl_multi_perform(_multi, &running);
+  lock.lock();
+  if (mres != CURLM_OK)
+  {
+    throw TransferError(string("curl_multi_perform() failed: ") +
+                        curl_multi_strerror(mres));
+  }
+  finishTransfers();
+  finishReplays();
+  writeStores(lock);
   
-  /* send all data to this function  */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
- 
-  /* we pass our 'chunk' struct to the callback function */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&_buffer);
+  if (running > 0 || !_retrying.empty() || !_replaying.empty())
+  {
+    // (unlike curl_multi_wait, this sleeps even if nothing is running)
+    int numfds = 0;
+    curl_multi_poll(_multi, NULL, 0, getWaitTimeout(), &numfds);
+  }
+}
+
+void Download::startQueued()
+{
+  while (!_queued.empty() && _inFlight < _maxInFlight)
+  {
+    Request* request = _queued.front();
+    _queued.pop_front();
+    try
+    {
+      start(request);
+    }
+    catch (runtime_error& e)
+    {
+      // (start() throws before the request is attached to anything)
+      request->error = e.what();
+      request->done = true;
+      _finished.notify_all();
+    }
+  }
+}
 
+void Download::start(Request* request)
+{
+  request->startTime = RunStats::now();
+  if (_transport == Replay)
+  {
+    startReplay(request);
+    return;
+  }
+  
+  CURL* handle = NULL;
+  if (!_idleHandles.empty())
+  {
+    handle = _idleHandles.back();
+    _idleHandles.pop_back();
+  }
+  else
+  {
+    handle = curl_easy_init();
+    if (handle == NULL)
+    {
+      throw runtime_error("curl_easy_init() failed");
+    }
+    curl_easy_setopt(handle, CURLOPT_SHARE, _share);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, 3600L);
+    // give up on (and retry) connections that can't be made
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 30L);
+    
+    /* send all data to this function  */ 
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
 #ifdef CURL_VERBOSE
-  curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(handle, CURLOPT_VERBOSE, 1L);
 #else
-  curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 0L);
+    curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
 #endif
-  
-  res = curl_easy_perform(curl_handle);
+  }
+
+  /* specify URL to get */
+  curl_easy_setopt(handle, CURLOPT_URL, request->url.c_str());
+
+  // (set every time, as the handle may be older than the setting.  a
+  // time of 0 turns the check off)
+  curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT,
+                   _stallTimeout > 0 ? 1L : 0L);
+  curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, _stallTimeout);
 
-  /* Check for errors */ 
-  if(res != CURLE_OK)
+  if (request->post)
   {
-    throw runtime_error(string("curl_easy_perform() failed: ") +
-                        curl_easy_strerror(res));
+    /* Now specify we want to POST data */ 
+    curl_easy_setopt(handle, CURLOPT_POST, 1L);
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE,
+                     (long)request->postData.length());
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request->postData.c_str());
+  }
+  else
+  {
+    /* Now specify we want to GET data */ 
+    curl_easy_setopt(handle, CURLOPT_HTTPGET, 1L);
+  }
+
+  /* an empty string asks for every encoding curl can decode.  NULL
+     turns decoding off */
+  curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING,
+                   _compression ? "" : NULL);
+
+  /* headers */
+  for (int i = 0; i < request->headers.size(); ++i)
+  {
+    request->curlHeaders = curl_slist_append(request->curlHeaders,
+                                             request->headers[i].c_str());
+  }
+  curl_easy_setopt(handle, CURLOPT_HTTPHEADER, request->curlHeaders);
+
+  /* we pass the request (for its buffer) to the callback function */ 
+  curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)request);
+  curl_easy_setopt(handle, CURLOPT_PRIVATE, (void *)request);
+
+  request->handle = handle;
+  curl_multi_add_handle(_multi, handle);
+  ++_inFlight;
+}
+
+void Download::finishTransfers()
+{
+  int msgsLeft = 0;
+  CURLMsg* msg = NULL;
+  while ((msg = curl_multi_info_read(_multi, &msgsLeft)) != NULL)
+  {
+    if (msg->msg != CURLMSG_DONE)
+    {
+      continue;
+    }
+    Request* request = NULL;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&request);
+    assert(request != NULL && request->handle == msg->easy_handle);
+
+    if (msg->data.result != CURLE_OK)
+    {
+      request->error = curl_easy_strerror(msg->data.result);
+    }
+    long numConnects = 0;
+    curl_easy_getinfo(request->handle, CURLINFO_NUM_CONNECTS, &numConnects);
+    curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE,
+                      &request->httpCode);
+    _connectionCount += numConnects;
+    curl_off_t wireBytes = 0;
+    curl_easy_getinfo(request->handle, CURLINFO_SIZE_DOWNLOAD_T, &wireBytes);
+    _bytesReceived += wireBytes;
+    _bytesDecoded += request->buffer.size;
+    ++_requestCount;
+    request->seconds = RunStats::now() - request->startTime;
+    if (_stats != NULL)
+    {
+      _stats->addRequest(request->url, request->post, request->seconds,
+                         wireBytes, request->buffer.size, numConnects);
+    }
+    
+    detach(request);
+    if (scheduleRetry(request, msg->data.result) == true)
+    {
+      if (_stats != NULL)
+      {
+        _stats->addRetry(request->url, request->post);
+      }
+    }
+    else
+    {
+      if (request->error.empty() &&
+          isTransient(CURLE_OK, request->httpCode) == true)
+      {
+        stringstream ss;
+        ss << "server returned HTTP " << request->httpCode << " after "
+           << request->retries << " retries";
+        request->error = ss.str();
+      }
+      // the response is copied, so the request can be handed back (and
+      // its buffer reused) before it's written
+      Store store;
+      store.archive = _transport == Record && request->error.empty();
+      store.cache = request->error.empty() && request->httpCode == 200;
+      if (store.archive || store.cache)
+      {
+        store.url = request->url;
+        store.postData = request->postData;
+        store.response.assign(request->buffer.memory, request->buffer.size);
+        store.httpCode = request->httpCode;
+        _stores.push_back(store);
+      }
+      request->done = true;
+    }
+  }
+}
+
+void Download::writeStores(unique_lock<mutex>& lock)
+{
+  if (_stores.empty())
+  {
+    return;
+  }
+  vector<Store> stores;
+  stores.swap(_stores);
+  lock.unlock();
+  {
+    lock_guard<mutex> cacheLock(_cacheMutex);
+    for (size_t i = 0; i < stores.size(); ++i)
+    {
+      const Store& store = stores[i];
+      if (store.archive && _archive.isOpen())
+      {
+        _archive.store(store.url, store.postData, store.response.data(),
+                       store.response.length(), store.httpCode);
+      }
+      if (store.cache && _cache.isOpen())
+      {
+        _cache.store(store.url, store.postData, store.response.data(),
+                     store.response.length());
+      }
+    }
+  }
+  lock.lock();
+}
+
+bool Download::scheduleRetry(Request* request, CURLcode result)
+{
+  if (request->retries >= _maxRetries ||
+      isTransient(result, request->httpCode) == false)
+  {
+    return false;
   }
   
-  curl_slist_free_all(curlHeaders);
-  curl_easy_cleanup(curl_handle);
+  double delay = min(_retryDelay * pow(2., request->retries), MaxRetryDelay);
+  uniform_real_distribution<double> jitter(0.5, 1.5);
+  delay *= jitter(_random);
+  request->wakeTime = steady_clock::now() +
+     duration_cast<steady_clock::duration>(duration<double>(delay));
 
-  return getBuffer();
+  // start over from scratch
+  request->error.clear();
+  request->httpCode = 0;
+  request->buffer.size = 0;
+  request->buffer.memory[0] = '\0';
+  request->streamable = false;
+  ++request->retries;
+  ++_retryCount;
+  _retrying.push_back(request);
+  return true;
 }
 
+void Download::queueRetries()
+{
+  steady_clock::time_point now = steady_clock::now();
+  for (int i = 0; i < _retrying.size();)
+  {
+    if (_retrying[i]->wakeTime <= now)
+    {
+      // these have been waiting longest, so they go first
+      _queued.push_front(_retrying[i]);
+      _retrying[i] = _retrying.back();
+      _retrying.pop_back();
+    }
+    else
+    {
+      ++i;
+    }
+  }
+}
 
-const char* Download::getBuffer()
+int Download::getWaitTimeout() const
 {
-  assert(_buffer.memory[_buffer.size] == '\0');
-  return _buffer.memory;
+  int timeout = 1000;
+  steady_clock::time_point now = steady_clock::now();
+  for (int i = 0; i < _retrying.size() + _replaying.size(); ++i)
+  {
+    Request* request = i < _retrying.size() ? _retrying[i] :
+       _replaying[i - _retrying.size()];
+    long long ms = duration_cast<milliseconds>(
+      request->wakeTime - now).count() + 1;
+    timeout = (int)max(0LL, min((long long)timeout, ms));
+  }
+  return timeout;
+}
+
+void Download::startReplay(Request* request)
+{
+  string response;
+  bool found;
+  {
+    lock_guard<mutex> cacheLock(_cacheMutex);
+    found = _archive.load(request->url, request->postData, response,
+                          &request->httpCode);
+  }
+  if (found == false)
+  {
+    request->error = "no response recorded for " + request->url;
+    if (request->post)
+    {
+      request->error += " with POST data " + request->postData;
+    }
+    request->done = true;
+    return;
+  }
+  if (appendToBuffer(request->buffer, response.data(),
+                     response.length()) == false)
+  {
+    request->error = "not enough memory for replayed response";
+    request->done = true;
+    return;
+  }
+  double seconds = _replayLatency;
+  if (_replayBandwidth > 0)
+  {
+    seconds += response.length() / _replayBandwidth;
+  }
+  request->wakeTime = steady_clock::now() +
+     duration_cast<steady_clock::duration>(duration<double>(seconds));
+  _replaying.push_back(request);
+  ++_inFlight;
+}
+
+void Download::finishReplays()
+{
+  steady_clock::time_point now = steady_clock::now();
+  for (int i = 0; i < _replaying.size();)
+  {
+    Request* request = _replaying[i];
+    if (request->wakeTime <= now)
+    {
+      ++_requestCount;
+      _bytesReceived += request->buffer.size;
+      _bytesDecoded += request->buffer.size;
+      request->seconds = RunStats::now() - request->startTime;
+      if (_stats != NULL)
+      {
+        _stats->addRequest(request->url, request->post, request->seconds,
+                           request->buffer.size, request->buffer.size, 0);
+      }
+      --_inFlight;
+      request->done = true;
+      _replaying[i] = _replaying.back();
+      _replaying.pop_back();
+    }
+    else
+    {
+      ++i;
+    }
+  }
+}
+
+void Download::detach(Request* request)
+{
+  assert(request->handle != NULL);
+  curl_multi_remove_handle(_multi, request->handle);
+  // headers can't outlive the request, so make sure the handle forgets them
+  curl_easy_setopt(request->handle, CURLOPT_HTTPHEADER, NULL);
+  curl_slist_free_all(request->curlHeaders);
+  request->curlHeaders = NULL;
+  _idleHandles.push_back(request->handle);
+  request->handle = NULL;
+  --_inFlight;
+}
+
+ResponseStream::ResponseStream(Download& download,
+                               Download::Request* request) :
+  _download(&download), _request(request), _insitu(false), _dst(NULL),
+  _attempt(-1), _interrupted(false), _ended(false), _waitSeconds(0.),
+  _begin(NULL), _pos(NULL), _end(NULL), _offset(0)
+{
+  if (download.isDone(request) && request->error.empty())
+  {
+    // nothing else touches the buffer now, so no need to copy it
+    _insitu = true;
+    _ended = true;
+    _begin = request->buffer.memory;
+    _end = _begin + request->buffer.size;
+  }
+  else
+  {
+    _chunk.resize(ChunkSize);
+    _begin = &_chunk[0];
+    _end = _begin;
+  }
+  _pos = _begin;
+}
+
+ResponseStream::ResponseStream(const char* response) :
+  _download(NULL), _request(NULL), _insitu(false), _dst(NULL),
+  _attempt(-1), _interrupted(false), _ended(true), _waitSeconds(0.),
+  _begin(response), _pos(response), _end(response + strlen(response)),
+  _offset(0)
+{
+
+}
+
+ResponseStream::ResponseStream(char* response, size_t length) :
+  _download(NULL), _request(NULL), _insitu(true), _dst(NULL),
+  _attempt(-1), _interrupted(false), _ended(true), _waitSeconds(0.),
+  _begin(response), _pos(response), _end(response + length),
+  _offset(0)
+{
+
+}
+
+ResponseStream::Ch ResponseStream::fill(bool take)
+{
+  assert(_pos == _end);
+  if (_ended)
+  {
+    return '\0';
+  }
+  _offset += _end - _begin;
+  double start = RunStats::now();
+  long count = _download->read(_request, _attempt, _offset, &_chunk[0],
+                               _chunk.size());
+  _waitSeconds += RunStats::now() - start;
+  if (count <= 0)
+  {
+    _interrupted = count < 0;
+    _ended = true;
+    count = 0;
+  }
+  _begin = &_chunk[0];
+  _pos = _begin;
+  _end = _begin + count;
+  if (_pos == _end)
+  {
+    return '\0';
+  }
+  return take ? *_pos++ : *_pos;
+}
+
+string ResponseStream::getText()
+{
+  if (_insitu)
+  {
+    // parsed strings end with a 0 where their closing quote was (which
+    // is all that changes, unless they had escapes)
+    string text(_begin, _end);
+    replace(text.begin(), text.end(), '\0', '"');
+    return text;
+  }
+  if (_download == NULL)
+  {
+    return _begin;
+  }
+  try
+  {
+    return _download->wait(_request);
+  }
+  catch (runtime_error& e)
+  {
+    return e.what();
+  }
 }
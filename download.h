@@ -7,22 +7,94 @@
 #ifndef _DOWNLOAD_H
 #define _DOWNLOAD_H
 
+#include <cassert>
 #include <string>
 #include <vector>
+#include <deque>
+#include <set>
 #include <limits>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <curl/curl.h>
 
 #include "sidegraph.h"
+#include "responsecache.h"
+#include "runstats.h"
 
 
+/** Thrown when a request couldn't be downloaded (after all its
+ * retries), as opposed to errors in what was downloaded */
+class TransferError : public std::runtime_error
+{
+public:
+   TransferError(const std::string& what) : std::runtime_error(what) {}
+};
+
 /** 
 Keep all HTTP access code wrapped in this one class, as it's something
 that I'm messing around with too much. 
+
+All transfers are driven by a single curl multi handle.  Requests can
+be submitted asynchronously (submitPost / submitGet), in which case 
+each one gets its own response buffer and up to getMaxInFlight() of them
+run in parallel whenever wait() or waitAll() is called.  The old 
+blocking interface (postRequest / getRequest) is just a submit followed
+by a wait.
+
+In background mode, the multi handle is driven by a dedicated I/O 
+thread instead of by wait(), so transfers keep going while the caller
+is busy with something else (like parsing the previous page).  All 
+curl calls on the multi handle are then made from that thread only.
+
+Easy handles are recycled, and a share handle holds the DNS, TLS 
+session and connection caches, so that consecutive requests to the 
+same server reuse open (keep-alive) connections instead of paying for
+a new handshake every time. 
+
+Response buffers are recycled too.  They only ever grow, and are 
+pre-sized from the Content-Length header when there is one, so after
+the first few pages there are next to no allocations or copies.
+
+Compressed (gzip / deflate) responses are requested by default. They
+are decoded by curl on the fly, so buffers only ever contain the
+uncompressed response.
+
+Requests that fail for reasons that are likely to go away (dropped 
+connections, timeouts, HTTP 429 / 5xx) are automatically retried, 
+with an exponentially growing, randomly jittered delay in between.
+wait() only throws (a TransferError) once all retries are used up.
+
+If a cache directory is set, successful responses are saved there, and
+requests that are found in it are done as soon as they are submitted
+without going anywhere near the network.
+
+Where the responses come from is set by the transport.  Live is the 
+normal case.  Record is Live plus saving every response (whatever its
+HTTP status) to an archive directory, in the cache's format.  Replay 
+serves requests from such an archive and never touches the network, 
+optionally pretending that each request takes a given latency and 
+bandwidth, so whole conversions can be tested and benchmarked offline.
+Replayed requests still obey getMaxInFlight().  The cache is only used
+by the Live transport.
+
+A response doesn't have to be waited for before it's used: read() 
+hands out its bytes as they arrive (see ResponseStream), so it can be
+parsed while the rest of it is still coming over the network.
 */
 class Download
 {
 public:
+
+   static const int DefaultMaxInFlight;
+   static const int DefaultMaxRetries;
+   static const double DefaultRetryDelay;
+
+   enum Transport { Live, Record, Replay };
    
    Download();
    ~Download();
@@ -36,17 +108,472 @@ public:
 
    const char* getRequest(const std::string& url,
                           const std::vector<std::string>& headers);                  
+   /** Null-terminated response buffer.  capacity is the number of bytes
+    * allocated, which is always at least size + 1 */
    struct MemoryStruct {
       char *memory;
       size_t size;
+      size_t capacity;
+   };
+
+   /** Append data to buffer, growing it geometrically (at least doubling 
+    * its capacity) so that a response arriving in many small chunks is 
+    * only copied a handful of times.  returns false if out of memory */
+   static bool appendToBuffer(MemoryStruct& buffer, const char* data,
+                              size_t length);
+
+   /** Make sure the buffer has at least capacity bytes allocated. 
+    * returns false if out of memory */
+   static bool reserveBuffer(MemoryStruct& buffer, size_t capacity);
+
+   /** An asynchronous request.  Created by submitPost or submitGet and
+    * owned by the Download object until it is released. */
+   struct Request {
+      std::string url;
+      std::vector<std::string> headers;
+      std::string postData;
+      bool post;
+      MemoryStruct buffer;
+      bool done;
+      std::string error;
+      long httpCode;
+      CURL* handle;
+      struct curl_slist* curlHeaders;
+      // number of times the request was retried
+      int retries;
+      // when to start the next retry (or when a replayed response arrives)
+      std::chrono::steady_clock::time_point wakeTime;
+      // when the current attempt was started (RunStats::now())
+      double startTime;
+      // how long the last attempt took (-1 if served from the cache)
+      double seconds;
+      // the current attempt got HTTP 200, so read() can hand out its 
+      // bytes before it's done
+      bool streamable;
+      // someone is waiting in read() for more bytes
+      bool streamed;
+      // (for the write callback)
+      Download* download;
    };
 
    const char* getBuffer();
    void clearBuffer();
 
+   /** Queue up a POST request.  It won't be started until wait() or
+    * waitAll() are called */
+   Request* submitPost(const std::string& url,
+                       const std::vector<std::string>& headers,
+                       const std::string& postData);
+
+   /** Queue up a GET request.  It won't be started until wait() or
+    * waitAll() are called */
+   Request* submitGet(const std::string& url,
+                      const std::vector<std::string>& headers);
+
+   /** Run transfers until given request is done, and return its 
+    * buffer (which stays valid until the request is released). Other
+    * queued requests make progress in the meantime. Throws 
+    * TransferError if the request failed. */
+   const char* wait(Request* request);
+
+   /** Run transfers until every queued request is done.  Errors are 
+    * not thrown here, but when wait() is called on the request */
+   void waitAll();
+
+   /** Copy up to length bytes of a request's response, starting at 
+    * offset, into out, running transfers until there are some to copy.
+    * Bytes of a successful (HTTP 200) response are handed out as soon
+    * as they arrive.  attempt should be -1 on the first call; it gets
+    * set to the attempt the bytes came from.  Returns the number of 
+    * bytes copied (0 at the end of the response), or -1 if that attempt
+    * failed (the request may be being retried, in which case the bytes
+    * read so far are no good: wait() for the request instead) */
+   long read(Request* request, int& attempt, size_t offset, char* out,
+             size_t length);
+
+   /** Free a request and its buffer, cancelling it if still running */
+   void release(Request* request);
+
+   /** Has the request finished (successfully or not)?  Once it has, its
+    * buffer is left alone until it's released */
+   bool isDone(Request* request);
+
+   /** Set the maximum number of requests that can be running at once */
+   void setMaxInFlight(int maxInFlight);
+   int getMaxInFlight() const;
+
+   /** Toggle driving transfers from a background I/O thread */
+   void setBackground(bool background);
+   bool getBackground() const;
+
+   /** Set the number of times a failed request is retried before giving
+    * up */
+   void setMaxRetries(int maxRetries);
+   int getMaxRetries() const;
+
+   /** Set the delay (in seconds) before the first retry of a request.  It
+    * doubles for every subsequent retry (up to a limit) and is randomly
+    * scaled by 0.5 to 1.5 so that parallel requests don't retry in sync */
+   void setRetryDelay(double seconds);
+   double getRetryDelay() const;
+
+   /** Give up on (and retry) a request that hasn't received anything
+    * for given number of seconds.  0 (the default) waits forever, as a
+    * slow server can take a long time to start sending a big page */
+   void setStallTimeout(long seconds);
+   long getStallTimeout() const;
+
+   /** Keep a persistent cache of responses in directory, using at most
+    * maxBytes of disk.  An empty directory turns the cache off */
+   void setCacheDir(const std::string& directory,
+                    size_t maxBytes = ResponseCache::DefaultMaxBytes);
+
+   /** Cache, for its statistics */
+   const ResponseCache& getCache() const;
+
+   /** Set where responses come from.  archiveDir is where responses are
+    * recorded to / replayed from (ignored for Live).  Throws 
+    * runtime_error if it can't be opened */
+   void setTransport(Transport transport,
+                     const std::string& archiveDir = std::string());
+   Transport getTransport() const;
+
+   /** Set how long replayed requests take: latency seconds plus 
+    * response size / bandwidth (in bytes per second, 0 for unlimited) */
+   void setReplaySpeed(double latency, double bandwidth);
+
+   /** Report every request to stats (NULL to stop) */
+   void setStats(RunStats* stats);
+
+   /** Toggle asking the server for compressed responses.  Only affects 
+    * requests started after the call */
+   void setCompression(bool compression);
+   bool getCompression() const;
+
+   /** number of requests performed so far */
+   size_t getRequestCount() const;
+
+   /** number of new connections that had to be opened so far.  If 
+    * keep-alive is working, this is much smaller than the number of
+    * requests */
+   size_t getConnectionCount() const;
+
+   /** number of response bytes that came over the wire so far (ie 
+    * before decompression) */
+   size_t getBytesReceived() const;
+
+   /** number of response bytes that ended up in the buffers so far (ie
+    * after decompression) */
+   size_t getBytesDecoded() const;
+
+   /** number of times requests were retried so far */
+   size_t getRetryCount() const;
+
 protected:
 
+   Request* submit(const std::string& url,
+                   const std::vector<std::string>& headers,
+                   const std::string& postData,
+                   bool post);
+
+   /** start queued requests, then let curl do some work, blocking
+    * until there is some activity (or timeout).  lock (on _mutex) is 
+    * released while curl works */
+   void step(std::unique_lock<std::mutex>& lock);
+
+   /** curl write callback: append data to a running request's buffer */
+   static size_t writeCallback(void* contents, size_t size, size_t nmemb,
+                               void* userp);
+
+   /** start a queued request on a free easy handle */
+   void start(Request* request);
+
+   /** start queued requests while there's room.  One that can't be 
+    * started is failed (so that wait() throws) rather than throwing 
+    * here, which would kill the I/O thread */
+   void startQueued();
+
+   /** harvest finished transfers from the multi handle */
+   void finishTransfers();
+
+   /** write the responses finishTransfers() saved up to the archive and
+    * cache.  lock (on _mutex) is released while they're written, so the
+    * disk doesn't hold up everyone else */
+   void writeStores(std::unique_lock<std::mutex>& lock);
+
+   /** if the request failed and is worth retrying, schedule the retry 
+    * and return true */
+   bool scheduleRetry(Request* request, CURLcode result);
+
+   /** move requests whose retry time has come back to the queue */
+   void queueRetries();
+
+   /** milliseconds to block waiting for activity: up to a second, but no 
+    * later than the next retry or replayed response */
+   int getWaitTimeout() const;
+
+   /** start a queued request by looking it up in the archive */
+   void startReplay(Request* request);
+
+   /** finish replayed requests whose time has come */
+   void finishReplays();
+
+   /** detach request from its handle, which gets put back in the pool */
+   void detach(Request* request);
+
+   /** free a request that's not running */
+   void destroy(Request* request);
+
+   /** get an empty buffer from the pool (or a new one if it's empty) */
+   MemoryStruct takeBuffer();
+
+   /** give a buffer back to the pool (or free it if the pool is full) */
+   void recycleBuffer(MemoryStruct& buffer);
+
+   /** main loop of background I/O thread */
+   void ioLoop();
+
    MemoryStruct _buffer;
+   CURLM* _multi;
+   CURLSH* _share;
+   std::vector<CURL*> _idleHandles;
+   std::vector<MemoryStruct> _freeBuffers;
+   std::deque<Request*> _queued;
+   std::set<Request*> _requests;
+   // running requests released in background mode, that the I/O thread
+   // needs to cancel and free
+   std::vector<Request*> _cancelled;
+   // failed requests waiting for their retry time
+   std::vector<Request*> _retrying;
+   // replayed requests waiting for their simulated transfer to finish
+   std::vector<Request*> _replaying;
+   // a copy of a finished response, waiting to be written to disk
+   struct Store {
+      std::string url;
+      std::string postData;
+      std::string response;
+      long httpCode;
+      bool archive;
+      bool cache;
+   };
+   std::vector<Store> _stores;
+   int _inFlight;
+   int _maxInFlight;
+   size_t _requestCount;
+   size_t _connectionCount;
+   size_t _bytesReceived;
+   size_t _bytesDecoded;
+   bool _compression;
+   int _maxRetries;
+   double _retryDelay;
+   long _stallTimeout;
+   size_t _retryCount;
+   std::mt19937 _random;
+   ResponseCache _cache;
+   Transport _transport;
+   ResponseCache _archive;
+   double _replayLatency;
+   double _replayBandwidth;
+   RunStats* _stats;
+   bool _background;
+   bool _stopping;
+   std::thread _ioThread;
+   std::mutex _mutex;
+   // guards _cache, _archive and _transport, so submit() can look in the
+   // cache (and writeStores() write to it) without holding _mutex.
+   // (taken after _mutex, never before)
+   std::mutex _cacheMutex;
+   // notified when requests finish, or streamed requests get data
+   std::condition_variable _finished;
+};
+
+/**
+rapidjson input stream over the response to a Download request, so it
+can be parsed (by a rapidjson::Reader) while it's still downloading. 
+Bytes are copied out of the request's buffer with Download::read() a 
+chunk at a time, as they arrive.  It can also just be made over a whole
+response that's already in memory.
+
+If the attempt that's being read fails partway through (and so gets
+retried), the stream just ends early and isInterrupted() is set.  The
+request then has to be waited for and parsed again from the start.
+
+A response that's all in a buffer we're allowed to modify (including a
+request that's already done) is parsed in situ (see isInsitu()): 
+strings are unescaped in place and handed to the parser's handler as 
+pointers into the buffer, rather than copied out first.
+*/
+class ResponseStream
+{
+public:
+   typedef char Ch;
+
+   /** stream over the response to request: in situ if it's already
+    * done, as it downloads otherwise */
+   ResponseStream(Download& download, Download::Request* request);
+   /** stream over a whole response */
+   ResponseStream(const char* response);
+   /** stream over a whole response of length bytes, to be parsed in 
+    * situ (which overwrites it) */
+   ResponseStream(char* response, size_t length);
+
+   Ch Peek();
+   Ch Take();
+   size_t Tell() const;
+   // only for parsing in situ
+   Ch* PutBegin();
+   void Put(Ch c);
+   void Flush() {}
+   size_t PutEnd(Ch* begin);
+
+   /** must the stream be parsed in situ (with kParseInsituFlag)? */
+   bool isInsitu() const;
+
+   /** did the attempt being read fail before the end? */
+   bool isInterrupted() const;
+
+   /** seconds spent waiting for bytes to arrive */
+   double getWaitSeconds() const;
+
+   /** the whole response (waiting for it if need be), for error 
+    * messages.  If it was parsed in situ, it's only roughly what it 
+    * was */
+   std::string getText();
+
+protected:
+
+   /** Get the next chunk, and return its first byte (also taking it if
+    * take is set), or 0 at the end of the response */
+   Ch fill(bool take = false);
+
+   static const size_t ChunkSize;
+
+   Download* _download;
+   Download::Request* _request;
+   bool _insitu;
+   // where the next in situ string byte goes
+   Ch* _dst;
+   int _attempt;
+   bool _interrupted;
+   bool _ended;
+   double _waitSeconds;
+   std::vector<char> _chunk;
+   const char* _begin;
+   const char* _pos;
+   const char* _end;
+   // offset of _begin in the response
+   size_t _offset;
 };
 
+inline ResponseStream::Ch ResponseStream::Peek()
+{
+  return _pos != _end ? *_pos : fill();
+}
+
+inline ResponseStream::Ch ResponseStream::Take()
+{
+  return _pos != _end ? *_pos++ : fill(true);
+}
+
+inline size_t ResponseStream::Tell() const
+{
+  return _offset + (_pos - _begin);
+}
+
+inline ResponseStream::Ch* ResponseStream::PutBegin()
+{
+  assert(_insitu);
+  return _dst = const_cast<Ch*>(_pos);
+}
+
+inline void ResponseStream::Put(Ch c)
+{
+  *_dst++ = c;
+}
+
+inline size_t ResponseStream::PutEnd(Ch* begin)
+{
+  return _dst - begin;
+}
+
+inline bool ResponseStream::isInsitu() const
+{
+  return _insitu;
+}
+
+inline bool ResponseStream::isInterrupted() const
+{
+  return _interrupted;
+}
+
+inline double ResponseStream::getWaitSeconds() const
+{
+  return _waitSeconds;
+}
+
+inline int Download::getMaxInFlight() const
+{
+  return _maxInFlight;
+}
+
+inline bool Download::getBackground() const
+{
+  return _background;
+}
+
+inline size_t Download::getRequestCount() const
+{
+  return _requestCount;
+}
+
+inline size_t Download::getConnectionCount() const
+{
+  return _connectionCount;
+}
+
+inline int Download::getMaxRetries() const
+{
+  return _maxRetries;
+}
+
+inline double Download::getRetryDelay() const
+{
+  return _retryDelay;
+}
+
+inline long Download::getStallTimeout() const
+{
+  return _stallTimeout;
+}
+
+inline size_t Download::getRetryCount() const
+{
+  return _retryCount;
+}
+
+inline const ResponseCache& Download::getCache() const
+{
+  return _cache;
+}
+
+inline Download::Transport Download::getTransport() const
+{
+  return _transport;
+}
+
+inline bool Download::getCompression() const
+{
+  return _compression;
+}
+
+inline size_t Download::getBytesReceived() const
+{
+  return _bytesReceived;
+}
+
+inline size_t Download::getBytesDecoded() const
+{
+  return _bytesDecoded;
+}
+
 #endif
@@ -53,8 +53,8 @@ sgExportPath=${rootPath}/sgExport
 rapidJsonPath=${rootPath}/rapidjson
 
 cflags +=  -I ${sgExportPath} ${platformCompileFlags}
-cppflags +=  -I ${sgExportPath} -I ${rapidJsonPath}/include ${platformCompileFlags}
-basicLibs = ${sgExportPath}/sgExport.a -static-libstdc++ -static-libgcc -lz ${platformLinkFlags} -lcurl
+cppflags +=  -std=c++11 -pthread -I ${sgExportPath} -I ${rapidJsonPath}/include ${platformCompileFlags}
+basicLibs = ${sgExportPath}/sgExport.a -static-libstdc++ -static-libgcc -lz ${platformLinkFlags} -lcurl -pthread
 basicLibsDependencies = ${sgExportPath}/sgExport.a
 
 
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#include <stdexcept>
+
+#include "joinindex.h"
+
+using namespace std;
+
+// size of a new table
+static const int MinBits = 4;
+
+JoinIndex::JoinIndex()
+{
+  clear();
+}
+
+JoinIndex::~JoinIndex()
+{
+
+}
+
+void JoinIndex::clear()
+{
+  _size = 0;
+  rehash(MinBits);
+}
+
+void JoinIndex::reserve(size_t joins)
+{
+  int bits = _bits;
+  while (((size_t)1 << bits) < joins * 2)
+  {
+    ++bits;
+  }
+  if (bits > _bits)
+  {
+    rehash(bits);
+  }
+}
+
+void JoinIndex::insert(const SGSide& side1, const SGSide& side2)
+{
+  Slot slot;
+  makeSlot(side1, side2, slot);
+  if (slot.seqIDs[0] < 0)
+  {
+    throw runtime_error("Join with negative sequence ID can't be indexed");
+  }
+  size_t i = find(slot);
+  if (_slots[i].seqIDs[0] == -1)
+  {
+    _slots[i] = slot;
+    ++_size;
+    if (_size * 2 > _slots.size())
+    {
+      rehash(_bits + 1);
+    }
+  }
+}
+
+void JoinIndex::rehash(int bits)
+{
+  vector<Slot> slots((size_t)1 << bits);
+  for (size_t i = 0; i < slots.size(); ++i)
+  {
+    slots[i].seqIDs[0] = -1;
+  }
+  slots.swap(_slots);
+  _bits = bits;
+  for (size_t i = 0; i < slots.size(); ++i)
+  {
+    if (slots[i].seqIDs[0] != -1)
+    {
+      _slots[find(slots[i])] = slots[i];
+    }
+  }
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#ifndef _JOININDEX_H
+#define _JOININDEX_H
+
+#include <vector>
+#include <cstdint>
+
+#include "sidegraph.h"
+
+/**
+Set of the joins in the side graph (by side graph sequence id), for
+checking that the joins implied by allele paths exist without a
+SGJoin and a tree lookup in the SideGraph's join set for every
+segment.  Joins are stored canonically (lower side first, with the
+strand packed into the position) in an open addressing hash table
+(linear probing, kept at most half full), so each is 32 bytes.
+
+Not thread safe for writing, but any number of threads can look up at
+once.
+*/
+class JoinIndex
+{
+public:
+
+   JoinIndex();
+   ~JoinIndex();
+
+   void clear();
+
+   /** make room for joins in total */
+   void reserve(size_t joins);
+
+   /** add a join (nothing happens if it's already there) */
+   void insert(const SGSide& side1, const SGSide& side2);
+
+   /** is there a join between the two sides (either way round)? */
+   bool contains(const SGSide& side1, const SGSide& side2) const;
+
+   size_t size() const;
+
+protected:
+
+   /** a canonical join: sides[0] <= sides[1], where a side is its
+    * sequence id and 2 * position + forward */
+   struct Slot {
+      sg_int_t seqIDs[2];
+      sg_int_t positions[2];
+   };
+
+   static void makeSlot(const SGSide& side1, const SGSide& side2,
+                        Slot& outSlot);
+   size_t getSlot(const Slot& slot) const;
+   size_t find(const Slot& slot) const;
+   /** (re)allocate the table with 2^bits slots */
+   void rehash(int bits);
+
+   std::vector<Slot> _slots;
+   int _bits;
+   size_t _size;
+};
+
+inline size_t JoinIndex::size() const
+{
+  return _size;
+}
+
+inline void JoinIndex::makeSlot(const SGSide& side1, const SGSide& side2,
+                                Slot& outSlot)
+{
+  sg_int_t seq1 = side1.getBase().getSeqID();
+  sg_int_t pos1 = side1.getBase().getPos() * 2 + side1.getForward();
+  sg_int_t seq2 = side2.getBase().getSeqID();
+  sg_int_t pos2 = side2.getBase().getPos() * 2 + side2.getForward();
+  bool swap = seq2 < seq1 || (seq2 == seq1 && pos2 < pos1);
+  outSlot.seqIDs[0] = swap ? seq2 : seq1;
+  outSlot.positions[0] = swap ? pos2 : pos1;
+  outSlot.seqIDs[1] = swap ? seq1 : seq2;
+  outSlot.positions[1] = swap ? pos1 : pos2;
+}
+
+inline size_t JoinIndex::getSlot(const Slot& slot) const
+{
+  const uint64_t k = 0x9E3779B97F4A7C15ULL;
+  uint64_t h = (uint64_t)slot.seqIDs[0] * k + (uint64_t)slot.positions[0];
+  h = h * k + (uint64_t)slot.seqIDs[1];
+  h = h * k + (uint64_t)slot.positions[1];
+  return (h * k) >> (64 - _bits);
+}
+
+inline size_t JoinIndex::find(const Slot& slot) const
+{
+  size_t mask = _slots.size() - 1;
+  size_t i = getSlot(slot);
+  // (an empty slot has sequence id -1)
+  while (_slots[i].seqIDs[0] != -1 &&
+         (_slots[i].seqIDs[0] != slot.seqIDs[0] ||
+          _slots[i].positions[0] != slot.positions[0] ||
+          _slots[i].seqIDs[1] != slot.seqIDs[1] ||
+          _slots[i].positions[1] != slot.positions[1]))
+  {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+inline bool JoinIndex::contains(const SGSide& side1,
+                                const SGSide& side2) const
+{
+  Slot slot;
+  makeSlot(side1, side2, slot);
+  return slot.seqIDs[0] >= 0 && _slots[find(slot)].seqIDs[0] != -1;
+}
+
+#endif
@@ -6,59 +6,527 @@
 
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
 
 #include "rapidjson/document.h"    
+#include "rapidjson/reader.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 
 #include "json2sg.h"
+#include "download.h"
+#include "bases.h"
 
 using namespace std;
 using namespace rapidjson;
 
-JSON2SG::JSON2SG()
+/**
+SAX handler (for rapidjson::Reader) of a page of search results, which
+look like 
+   {"<records>": [{...}, {...}, ...], "nextPageToken": "<token>"|null}
+It keeps track of where in the document we are, so that subclasses
+only have to deal with the fields of one record at a time.  A field is
+identified by its path in the record, ex "side1.base.position".  Null
+fields are passed with value NULL, and numbers and booleans are 
+passed as strings, as the server gives almost everything as strings 
+anyway.
+
+Any handler function returning false stops the parse.  If that's
+because a record was bad, the reason is in getError().
+*/
+class PageHandler
 {
+public:
+   PageHandler(const char* records) : _records(records), _depth(0),
+                                      _inRecords(false), _inRecord(false),
+                                      _found(false), _nextPageToken(-2) {}
+   virtual ~PageHandler() {}
+
+   bool Null() { return value(NULL, 0); }
+   bool Bool(bool b) { return b ? value("true", 4) : value("false", 5); }
+   bool Int(int i) { return number("%d", i); }
+   bool Uint(unsigned u) { return number("%u", u); }
+   bool Int64(int64_t i) { return number("%lld", (long long)i); }
+   bool Uint64(uint64_t u) { return number("%llu", (unsigned long long)u); }
+   bool Double(double d) { return number("%.17g", d); }
+   bool RawNumber(const char* str, SizeType length, bool)
+   {
+     return value(str, length);
+   }
+   bool String(const char* str, SizeType length, bool)
+   {
+     return value(str, length);
+   }
+   bool StartObject();
+   bool Key(const char* str, SizeType length, bool);
+   bool EndObject(SizeType);
+   bool StartArray();
+   bool EndArray(SizeType);
+
+   /** was the records array in the page? */
+   bool getFound() const { return _found; }
+   /** -1 = NULL, -2 = missing or error */
+   int getNextPageToken() const { return _nextPageToken; }
+   const string& getError() const { return _error; }
+   
+protected:
+
+   /** a new record starts */
+   virtual void startRecord() = 0;
+   /** a field of the current record */
+   virtual bool field(const string& path, const char* value,
+                      SizeType length) = 0;
+   /** the record is done: check it and add it to the output */
+   virtual bool endRecord() = 0;
+
+   /** stop with given error (with reason saying what's wrong with the
+    * field, if there's more to say than that it's missing or not a
+    * number) */
+   bool fail(const string& path, const string& reason = "");
 
+   /** convert the value of the field at path */
+   template <typename T>
+   bool convert(const string& path, const char* value, SizeType length,
+                T& out);
+
+   bool value(const char* str, SizeType length);
+   template <typename T>
+   bool number(const char* format, T n);
+
+   const char* _records;
+   int _depth;
+   // key of the current member of the top-level object
+   string _key;
+   bool _inRecords;
+   bool _inRecord;
+   // path of the current field in the record
+   string _path;
+   // length of _path at the start of each object we're in (in the record)
+   vector<size_t> _pathStart;
+   bool _found;
+   int _nextPageToken;
+   string _error;
+};
+
+bool PageHandler::StartObject()
+{
+  ++_depth;
+  if (_inRecord)
+  {
+    _pathStart.push_back(_path.size());
+  }
+  else if (_inRecords && _depth == 3)
+  {
+    _inRecord = true;
+    _path.clear();
+    _pathStart.assign(1, 0);
+    startRecord();
+  }
+  return true;
 }
 
-JSON2SG::~JSON2SG()
+bool PageHandler::Key(const char* str, SizeType length, bool)
 {
-  
+  if (_inRecord)
+  {
+    _path.resize(_pathStart.back());
+    if (!_path.empty())
+    {
+      _path += '.';
+    }
+    _path.append(str, length);
+  }
+  else if (_depth == 1)
+  {
+    _key.assign(str, length);
+  }
+  return true;
 }
 
-int JSON2SG::parseSequences(const char* buffer,
-                            vector<SGSequence*>& outSeqs,
-                            vector<string>& outBases,
-                            int& outNextPageToken)
+bool PageHandler::EndObject(SizeType)
 {
-  outSeqs.clear();
-  outBases.clear();
-  Document json;
-  json.Parse(buffer);
-  outNextPageToken = getNextPageToken(json);
-  if (!json.HasMember("sequences"))
+  --_depth;
+  if (_inRecord)
   {
-    return -1;
+    _pathStart.pop_back();
+    if (_pathStart.empty())
+    {
+      _inRecord = false;
+      return endRecord();
+    }
   }
-  const Value& jsonSeqArray = json["sequences"];
-  outSeqs.resize(jsonSeqArray.Size());
-  outBases.resize(outSeqs.size());
+  return true;
+}
 
-  // rapidjson uses SizeType instead of size_t.
-  for (SizeType i = 0; i < jsonSeqArray.Size(); i++)
+bool PageHandler::StartArray()
+{
+  ++_depth;
+  if (_depth == 2 && _key == _records)
+  {
+    _inRecords = true;
+    _found = true;
+  }
+  return true;
+}
+
+bool PageHandler::EndArray(SizeType)
+{
+  if (_depth == 2)
+  {
+    _inRecords = false;
+  }
+  --_depth;
+  return true;
+}
+
+bool PageHandler::value(const char* str, SizeType length)
+{
+  if (_inRecord)
+  {
+    return field(_path, str, length);
+  }
+  if (_depth == 1 && _key == "nextPageToken")
   {
-    SGSequence seq = parseSequence(jsonSeqArray[i]);
-    outSeqs[i] = new SGSequence(seq.getID(), seq.getLength(), seq.getName());
-    if (!jsonSeqArray[i].HasMember("bases"))
+    _nextPageToken = -1;
+    if (str != NULL && convert(_key, str, length, _nextPageToken) == false)
     {
-      throw std::runtime_error(std::string("Error parsing JSON field: bases"));
+      // not a record problem: the page is just no good
+      _nextPageToken = -2;
+      _error.clear();
+      return false;
     }
-    if (!jsonSeqArray[i]["bases"].IsNull())
+  }
+  else if (_depth == 1 && _key == _records)
+  {
+    // not an array
+    return fail(_key);
+  }
+  return true;
+}
+
+template <typename T>
+bool PageHandler::number(const char* format, T n)
+{
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), format, n);
+  return value(buffer, length);
+}
+
+bool PageHandler::fail(const string& path, const string& reason)
+{
+  _error = "Error parsing JSON field: " + path;
+  if (!reason.empty())
+  {
+    _error += ": " + reason;
+  }
+  return false;
+}
+
+template <typename T>
+bool PageHandler::convert(const string& path, const char* value,
+                          SizeType length, T& out)
+{
+  if (value == NULL || JSON2SG::convertString(value, length, out) == false)
+  {
+    return fail(path);
+  }
+  return true;
+}
+
+/** SAX handler for a page of sequences.  The bases of each sequence
+ * are checked (and upper-cased if upperCase) as soon as it's done,
+ * while they're still in cache. */
+class SequencePageHandler : public PageHandler
+{
+public:
+   SequencePageHandler(SequenceBatch& outSeqs, bool upperCase) :
+     PageHandler("sequences"), _outSeqs(outSeqs), _upperCase(upperCase) {}
+protected:
+   virtual void startRecord()
+   {
+     _hasID = _hasLength = _hasBases = _nullBases = false;
+     _bases.clear();
+   }
+   virtual bool field(const string& path, const char* value,
+                      SizeType length)
+   {
+     if (path == "id")
+     {
+       _hasID = true;
+       return convert(path, value, length, _id);
+     }
+     else if (path == "length")
+     {
+       _hasLength = true;
+       return convert(path, value, length, _length);
+     }
+     else if (path == "bases")
+     {
+       _hasBases = true;
+       _nullBases = value == NULL;
+       return _nullBases || convert(path, value, length, _bases);
+     }
+     return true;
+   }
+   virtual bool endRecord()
+   {
+     if (!_hasID || !_hasLength || !_hasBases)
+     {
+       return fail(!_hasID ? "id" : !_hasLength ? "length" : "bases");
+     }
+     if (!_nullBases)
+     {
+       size_t bad = normalizeBases(&_bases[0], _bases.size(), _upperCase);
+       if (bad != _bases.size())
+       {
+         stringstream ss;
+         ss << "invalid base '" << _bases[bad] << "' at position " << bad
+            << " of sequence " << _id;
+         return fail("bases", ss.str());
+       }
+       if ((sg_int_t)_bases.size() != _length)
+       {
+         stringstream ss;
+         ss << _bases.size() << " bases for sequence " << _id
+            << " of length " << _length;
+         return fail("bases", ss.str());
+       }
+     }
+     // note: we don't seem to have a name field in the json
+     _outSeqs.ids.push_back(_id);
+     _outSeqs.lengths.push_back(_length);
+     _outSeqs.bases.push_back(string());
+     _outSeqs.bases.back().swap(_bases);
+     return true;
+   }
+   SequenceBatch& _outSeqs;
+   bool _upperCase;
+   sg_int_t _id;
+   sg_int_t _length;
+   string _bases;
+   bool _hasID;
+   bool _hasLength;
+   bool _hasBases;
+   bool _nullBases;
+};
+
+/** SAX handler for a page of references */
+class ReferencePageHandler : public PageHandler
+{
+public:
+   ReferencePageHandler(map<int, string>& outMap) :
+     PageHandler("references"), _outMap(outMap) {}
+protected:
+   virtual void startRecord()
+   {
+     _hasName = _hasID = false;
+   }
+   virtual bool field(const string& path, const char* value,
+                      SizeType length)
+   {
+     if (path == "name")
+     {
+       _hasName = true;
+       return convert(path, value, length, _name);
+     }
+     else if (path == "sequenceId")
+     {
+       _hasID = true;
+       return convert(path, value, length, _id);
+     }
+     return true;
+   }
+   virtual bool endRecord()
+   {
+     if (!_hasName || !_hasID)
+     {
+       return fail(!_hasName ? "name" : "sequenceId");
+     }
+     _outMap.insert(pair<int, string>(_id, _name));
+     return true;
+   }
+   map<int, string>& _outMap;
+   string _name;
+   int _id;
+   bool _hasName;
+   bool _hasID;
+};
+
+/** SAX handler for a page of joins */
+class JoinPageHandler : public PageHandler
+{
+public:
+   JoinPageHandler(JoinBatch& outJoins) :
+     PageHandler("joins"), _outJoins(outJoins) {}
+protected:
+   // fields of a join, in the order of _values
+   static const char* Fields[];
+   static const int NumFields = 6;
+   virtual void startRecord()
+   {
+     _seen = 0;
+   }
+   virtual bool field(const string& path, const char* value,
+                      SizeType length)
+   {
+     for (int i = 0; i < NumFields; ++i)
+     {
+       if (path == Fields[i])
+       {
+         _seen |= 1 << i;
+         if (i % 3 == 2)
+         {
+           // strand
+           if (value != NULL && length == 10 &&
+               (strncmp(value, "POS_STRAND", length) == 0 ||
+                strncmp(value, "NEG_STRAND", length) == 0))
+           {
+             _values[i] = value[0] == 'P';
+             return true;
+           }
+           return fail(path);
+         }
+         return convert(path, value, length, _values[i]);
+       }
+     }
+     return true;
+   }
+   virtual bool endRecord()
+   {
+     for (int i = 0; i < NumFields; ++i)
+     {
+       if ((_seen & (1 << i)) == 0)
+       {
+         return fail(Fields[i]);
+       }
+     }
+     for (int side = 0; side < 2; ++side)
+     {
+       _outJoins.seqIDs[side].push_back(_values[side * 3]);
+       _outJoins.positions[side].push_back(_values[side * 3 + 1]);
+       _outJoins.forward[side].push_back(_values[side * 3 + 2] != 0);
+     }
+     return true;
+   }
+   JoinBatch& _outJoins;
+   sg_int_t _values[NumFields];
+   // bit i set if we've seen Fields[i]
+   int _seen;
+};
+
+const char* JoinPageHandler::Fields[] = {
+  "side1.base.sequenceId", "side1.base.position", "side1.strand",
+  "side2.base.sequenceId", "side2.base.position", "side2.strand"};
+
+/** SAX handler for a page of alleles (we only want their ids) */
+class AllelePageHandler : public PageHandler
+{
+public:
+   AllelePageHandler(vector<int>& outAlleleIDs) :
+     PageHandler("alleles"), _outAlleleIDs(outAlleleIDs) {}
+protected:
+   virtual void startRecord()
+   {
+     _hasID = false;
+   }
+   virtual bool field(const string& path, const char* value,
+                      SizeType length)
+   {
+     if (path == "id")
+     {
+       _hasID = true;
+       return convert(path, value, length, _id);
+     }
+     return true;
+   }
+   virtual bool endRecord()
+   {
+     if (!_hasID)
+     {
+       return fail("id");
+     }
+     _outAlleleIDs.push_back(_id);
+     return true;
+   }
+   vector<int>& _outAlleleIDs;
+   int _id;
+   bool _hasID;
+};
+
+/** Parse a page with a SAX handler.  returns false if the page isn't
+ * valid JSON or the records array is missing.  throws runtime_error if
+ * a record is bad */
+static bool parsePage(Reader& reader, ResponseStream& stream,
+                      PageHandler& handler, int& outNextPageToken)
+{
+  if (stream.isInsitu())
+  {
+    reader.Parse<kParseInsituFlag>(stream, handler);
+  }
+  else
+  {
+    reader.Parse(stream, handler);
+  }
+  if (!handler.getError().empty() && !stream.isInterrupted())
+  {
+    throw runtime_error(handler.getError());
+  }
+  if (reader.HasParseError())
+  {
+    outNextPageToken = -2;
+    return false;
+  }
+  outNextPageToken = handler.getNextPageToken();
+  return handler.getFound();
+}
+
+/** DOM whose values and parse stack both come from a MemoryPoolAllocator,
+ * so that everything can live in a JSON2SG's arena */
+typedef GenericDocument<UTF8<>, MemoryPoolAllocator<>,
+                        MemoryPoolAllocator<> > ArenaDocument;
+
+// initial size of an ArenaDocument's parse stack (rapidjson's default)
+static const size_t ArenaStackCapacity = 1024;
+
+const size_t JSON2SG::DefaultArenaSize = 64 * 1024;
+
+JSON2SG::JSON2SG() : _arena(DefaultArenaSize), _upperCase(false)
+{
+
+}
+
+JSON2SG::~JSON2SG()
+{
+  
+}
+
+int JSON2SG::parseSequences(const char* buffer, SequenceBatch& outSeqs,
+                            int& outNextPageToken)
+{
+  ResponseStream stream(buffer);
+  return parseSequences(stream, outSeqs, outNextPageToken);
+}
+
+int JSON2SG::parseSequences(ResponseStream& stream, SequenceBatch& outSeqs,
+                            int& outNextPageToken)
+{
+  size_t start = outSeqs.size();
+  SequencePageHandler handler(outSeqs, _upperCase);
+  try
+  {
+    if (parsePage(_reader, stream, handler, outNextPageToken) == false)
     {
-      outBases[i] = extractStringVal<string>(jsonSeqArray[i], "bases");
+      outSeqs.resize(start);
+      return -1;
     }
   }
-  return outSeqs.size();
+  catch (...)
+  {
+    outSeqs.resize(start);
+    throw;
+  }
+  return outSeqs.size() - start;
 }
 
 SGSequence JSON2SG::parseSequence(const Value& val)
@@ -72,24 +540,21 @@ SGSequence JSON2SG::parseSequence(const Value& val)
 int JSON2SG::parseReferences(const char* buffer,
                              map<int, string>& outMap,
                              int& outNextPageToken)
+{
+  ResponseStream stream(buffer);
+  return parseReferences(stream, outMap, outNextPageToken);
+}
+
+int JSON2SG::parseReferences(ResponseStream& stream,
+                             map<int, string>& outMap,
+                             int& outNextPageToken)
 {
   outMap.clear();
-  Document json;
-  json.Parse(buffer);
-  outNextPageToken = getNextPageToken(json);
-  if (!json.HasMember("references"))
+  ReferencePageHandler handler(outMap);
+  if (parsePage(_reader, stream, handler, outNextPageToken) == false)
   {
     return -1;
   }
-  const Value& jsonRefs = json["references"];
-  assert(jsonRefs.IsArray());
-  for (SizeType i = 0; i < jsonRefs.Size(); i++)
-  {
-    const Value& refVal = jsonRefs[i];
-    string name = extractStringVal<string>(refVal, "name");
-    int id = extractStringVal<int>(refVal, "sequenceId");
-    outMap.insert(pair<int, string>(id, name));
-  }
   return outMap.size();
 }
 
@@ -103,34 +568,41 @@ int JSON2SG::parseBases(const char* buffer, string& outBases)
     return -1;
   }
   const Value& jsonSeq = json["sequence"];
-  outBases = jsonSeq.GetString();
+  outBases.assign(jsonSeq.GetString(), jsonSeq.GetStringLength());
+  if (normalizeBases(&outBases[0], outBases.size(), _upperCase) !=
+      outBases.size())
+  {
+    return -1;
+  }
   return outBases.size();
 }
 
-int JSON2SG::parseJoins(const char* buffer, vector<SGJoin*>& outJoins,
+int JSON2SG::parseJoins(const char* buffer, JoinBatch& outJoins,
                         int& outNextPageToken)
 {
-  outJoins.clear();
-  // Read in the JSON string into Side Graph objects
-  Document json;
-  json.Parse(buffer);
-  outNextPageToken = getNextPageToken(json);
-  if (!json.HasMember("joins"))
+  ResponseStream stream(buffer);
+  return parseJoins(stream, outJoins, outNextPageToken);
+}
+
+int JSON2SG::parseJoins(ResponseStream& stream, JoinBatch& outJoins,
+                        int& outNextPageToken)
+{
+  size_t start = outJoins.size();
+  JoinPageHandler handler(outJoins);
+  try
   {
-    return -1;
+    if (parsePage(_reader, stream, handler, outNextPageToken) == false)
+    {
+      outJoins.resize(start);
+      return -1;
+    }
   }
-  const Value& jsonJoinArray = json["joins"];
-  outJoins.resize(jsonJoinArray.Size());
-  
-  // rapidjson uses SizeType instead of size_t.
-  for (SizeType i = 0; i < jsonJoinArray.Size(); i++)
+  catch (...)
   {
-    SGSide sgSide1 = parseSide(jsonJoinArray[i]["side1"]);
-    SGSide sgSide2 = parseSide(jsonJoinArray[i]["side2"]);
-    SGJoin* sgJoin = new SGJoin(sgSide1, sgSide2);
-    outJoins[i] = sgJoin;
+    outJoins.resize(start);
+    throw;
   }
-  return outJoins.size();
+  return outJoins.size() - start;
 }
 
 SGSide JSON2SG::parseSide(const Value& val)
@@ -150,37 +622,48 @@ SGPosition JSON2SG::parsePosition(const Value& val)
   return SGPosition(seqid, pos);
 }
 
-/** Parse out Allele IDs out of alleles array */
 int JSON2SG::parseAlleleIDs(const char* buffer, vector<int>& outAlleleIDs,
                             int& outNextPageToken)
+{
+  ResponseStream stream(buffer);
+  return parseAlleleIDs(stream, outAlleleIDs, outNextPageToken);
+}
+
+int JSON2SG::parseAlleleIDs(ResponseStream& stream, vector<int>& outAlleleIDs,
+                            int& outNextPageToken)
 {
   outAlleleIDs.clear();
-  // Read in the JSON string into Side Graph objects
-  Document json;
-  json.Parse(buffer);
-  outNextPageToken = getNextPageToken(json);
-  if (!json.HasMember("alleles"))
+  AllelePageHandler handler(outAlleleIDs);
+  if (parsePage(_reader, stream, handler, outNextPageToken) == false)
   {
     return -1;
   }
-  const Value& jsonAlleleArray = json["alleles"];
-  
-  // rapidjson uses SizeType instead of size_t.
-  for (SizeType i = 0; i < jsonAlleleArray.Size(); i++)
-  {
-    int id = extractStringVal<int>(jsonAlleleArray[i], "id");
-    outAlleleIDs.push_back(id);
-  }
   return outAlleleIDs.size();
 }
 
 int JSON2SG::parseAllele(const char* buffer, int& outID,
                          vector<SGSegment>& outPath,
                          int& outVariantSetID, string& outName)
+{
+  int ret;
+  size_t arenaUsed;
+  {
+    MemoryPoolAllocator<> allocator(&_arena[0], _arena.size());
+    ArenaDocument json(&allocator, ArenaStackCapacity, &allocator);
+    json.Parse(buffer);
+    ret = parseAllele(json, outID, outPath, outVariantSetID, outName);
+    arenaUsed = allocator.Size();
+  }
+  // (the allocator touches the arena until it's destroyed)
+  growArena(arenaUsed);
+  return ret;
+}
+
+int JSON2SG::parseAllele(const Value& json, int& outID,
+                         vector<SGSegment>& outPath,
+                         int& outVariantSetID, string& outName)
 {
   outPath.clear();  
-  Document json;
-  json.Parse(buffer);
 
   if (!json.HasMember("name") ||
       !json.HasMember("path") ||
@@ -227,6 +710,16 @@ SGSegment JSON2SG::parseSegment(const Value& val)
   return SGSegment(sgSide, length);
 }
 
+void JSON2SG::growArena(size_t arenaUsed)
+{
+  // leave room for the allocator's bookkeeping and the stack being
+  // moved as it grows
+  if (arenaUsed * 2 > _arena.size())
+  {
+    _arena.resize(arenaUsed * 2);
+  }
+}
+
 int JSON2SG::getNextPageToken(const Value& val)
 {
   if (val.HasMember("nextPageToken"))
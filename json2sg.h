@@ -10,18 +10,71 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <limits>
+#include <cctype>
 #include <stdexcept>
 
 #include "rapidjson/document.h"
 
 #include "sidegraph.h"
 
+class ResponseStream;
+
+/** Sequences parsed from pages, as parallel arrays (one element per
+ * sequence) rather than one heap object each, so that SGClient can
+ * check them and add them to the side graph in one loop. */
+struct SequenceBatch
+{
+   std::vector<sg_int_t> ids;
+   std::vector<sg_int_t> lengths;
+   std::vector<std::string> bases;
+
+   size_t size() const;
+   void clear();
+   /** drop everything after the first size sequences */
+   void resize(size_t size);
+   /** move the sequences in batch onto the end (batch is cleared) */
+   void append(SequenceBatch& batch);
+};
+
+/** Joins parsed from pages, as parallel arrays indexed by side (0 or 1)
+ * then join. */
+struct JoinBatch
+{
+   std::vector<sg_int_t> seqIDs[2];
+   std::vector<sg_int_t> positions[2];
+   // (not vector<bool>, so each element is addressable)
+   std::vector<char> forward[2];
+
+   size_t size() const;
+   void clear();
+   /** drop everything after the first size joins */
+   void resize(size_t size);
+   /** move the joins in batch onto the end (batch is cleared) */
+   void append(JoinBatch& batch);
+   void push_back(const SGSide& side1, const SGSide& side2);
+   SGSide getSide(int side, size_t i) const;
+   SGJoin getJoin(size_t i) const;
+};
+
 /** put all JSON -> In-memory-sidegraph conversion in one place.  
 We are not taking advantage of any schemas or anything, so expected
 format is hard coded in each parse function.
 
 Top-level parse functions check for errors and return -1 if any problems are
 found.  Lower-level functions will probably assert fail or throw exception.
+
+The pages of the searches (sequences, references, joins and alleles) 
+are parsed with rapidjson's SAX Reader, which hands each field straight
+to a handler that builds the records, so no DOM of the whole page is 
+ever built.  They can be parsed from a ResponseStream, which lets them
+be parsed while they download, or in situ in the download buffer, in 
+which case strings (like bases) are only copied once, into the output.
+
+A parser keeps its SAX reader (and so its parse stack) and an arena
+for the DOM of alleles from one call to the next, so it should be
+reused for every page of a download.  Not thread safe: use one per
+thread.
 */
 class JSON2SG
 {
@@ -29,10 +82,18 @@ public:
    JSON2SG();
    ~JSON2SG();
 
-   /** Parse sequences array.  Note, caller is responsible for freeing seqs.
+   /** toggle upper-casing the bases of the sequences that are parsed
+    * (off by default).  Either way, bases that aren't IUPAC nucleotide
+    * codes, or that don't match the length of their sequence, are 
+    * an error. */
+   void setUpperCase(bool upperCase);
+
+   /** Parse sequences array, appending them to outSeqs (which is left
+    * as it was if there's an error).
     * returns number of sequences or -1 if (top level) error */
-   int parseSequences(const char* buffer, std::vector<SGSequence*>& outSeqs,
-                      std::vector<std::string>& outBases,
+   int parseSequences(const char* buffer, SequenceBatch& outSeqs,
+                      int& outNextPageToken);
+   int parseSequences(ResponseStream& stream, SequenceBatch& outSeqs,
                       int& outNextPageToken);
 
    /** Parse single sequence. */
@@ -41,14 +102,21 @@ public:
    /** Parse references into id->name map */
    int parseReferences(const char* buffer, std::map<int, std::string>& outMap,
                        int& outNextPageToken);
+   int parseReferences(ResponseStream& stream,
+                       std::map<int, std::string>& outMap,
+                       int& outNextPageToken);
 
    /** Parse squence bases. 
-    * returns number of bases or -1 if error */
+    * returns number of bases or -1 if error (including bases that
+    * aren't IUPAC codes) */
    int parseBases(const char* buffer, std::string& outBases);
 
-   /** Parse joins array.  Note, caller is responsible for freeing joins.
+   /** Parse joins array, appending them to outJoins (which is left as
+    * it was if there's an error).
     * returns number of joins or -1 if (top-level) error */
-   int parseJoins(const char* buffer, std::vector<SGJoin*>& outJoins,
+   int parseJoins(const char* buffer, JoinBatch& outJoins,
+                  int& outNextPageToken);
+   int parseJoins(ResponseStream& stream, JoinBatch& outJoins,
                   int& outNextPageToken);
 
    /** Parse single join.  Note, caller responsible for freeing join */
@@ -63,12 +131,17 @@ public:
    /** Parse out Allele IDs out of alleles array */
    int parseAlleleIDs(const char* buffer, std::vector<int>& outAlleleIDs,
                       int& outNextPageToken);
+   int parseAlleleIDs(ResponseStream& stream, std::vector<int>& outAlleleIDs,
+                      int& outNextPageToken);
 
    /** Parse Allele.
     * returns number of segments in path or -1 if error */
    int parseAllele(const char* buffer, int& outID,
                    std::vector<SGSegment>& outPath,
                    int& outVariantSetID, std::string& outName);
+   int parseAllele(const rapidjson::Value& json, int& outID,
+                   std::vector<SGSegment>& outPath,
+                   int& outVariantSetID, std::string& outName);
 
    /** Parse Segment Path */
    int parseAllelePath(const rapidjson::Value& val,
@@ -82,14 +155,127 @@ public:
    template <typename T>
    T extractStringVal(const rapidjson::Value& val, const char* field);
 
+   /** Convert the length characters at str to an integer, without 
+    * allocating anything or looking at the locale (unlike a 
+    * stringstream).  returns false if they're not a whole integer that
+    * fits in T */
+   template <typename T>
+   static bool convertString(const char* str, size_t length, T& out);
+   static bool convertString(const char* str, size_t length,
+                             std::string& out);
+
    /** get the nextPageToken.  It's stored as a string.  We convert it to
     * int with following convetion: -1 = NULL, -2 = Error */
    int getNextPageToken(const rapidjson::Value& val);
 
+   /** Size the DOM arena starts at */
+   static const size_t DefaultArenaSize;
+
 protected:
-   // hmm maybe i shouldnt be a class
+
+   /** Make the arena bigger if a document that used arenaUsed bytes 
+    * of it didn't (comfortably) fit */
+   void growArena(size_t arenaUsed);
+
+   // SAX reader for pages, which keeps its stack between parses
+   rapidjson::Reader _reader;
+   // buffer that DOM values and parse stacks get allocated from (with
+   // a fresh MemoryPoolAllocator for each document)
+   std::vector<char> _arena;
+   bool _upperCase;
 };
 
+inline void JSON2SG::setUpperCase(bool upperCase)
+{
+  _upperCase = upperCase;
+}
+
+inline size_t SequenceBatch::size() const
+{
+  return ids.size();
+}
+
+inline void SequenceBatch::clear()
+{
+  resize(0);
+}
+
+inline void SequenceBatch::resize(size_t size)
+{
+  ids.resize(size);
+  lengths.resize(size);
+  bases.resize(size);
+}
+
+inline void SequenceBatch::append(SequenceBatch& batch)
+{
+  size_t offset = size();
+  ids.insert(ids.end(), batch.ids.begin(), batch.ids.end());
+  lengths.insert(lengths.end(), batch.lengths.begin(), batch.lengths.end());
+  bases.resize(offset + batch.size());
+  for (size_t i = 0; i < batch.size(); ++i)
+  {
+    bases[offset + i].swap(batch.bases[i]);
+  }
+  batch.clear();
+}
+
+inline size_t JoinBatch::size() const
+{
+  return seqIDs[0].size();
+}
+
+inline void JoinBatch::clear()
+{
+  resize(0);
+}
+
+inline void JoinBatch::resize(size_t size)
+{
+  for (int side = 0; side < 2; ++side)
+  {
+    seqIDs[side].resize(size);
+    positions[side].resize(size);
+    forward[side].resize(size);
+  }
+}
+
+inline void JoinBatch::append(JoinBatch& batch)
+{
+  for (int side = 0; side < 2; ++side)
+  {
+    seqIDs[side].insert(seqIDs[side].end(), batch.seqIDs[side].begin(),
+                        batch.seqIDs[side].end());
+    positions[side].insert(positions[side].end(),
+                           batch.positions[side].begin(),
+                           batch.positions[side].end());
+    forward[side].insert(forward[side].end(), batch.forward[side].begin(),
+                         batch.forward[side].end());
+  }
+  batch.clear();
+}
+
+inline void JoinBatch::push_back(const SGSide& side1, const SGSide& side2)
+{
+  seqIDs[0].push_back(side1.getBase().getSeqID());
+  positions[0].push_back(side1.getBase().getPos());
+  forward[0].push_back(side1.getForward());
+  seqIDs[1].push_back(side2.getBase().getSeqID());
+  positions[1].push_back(side2.getBase().getPos());
+  forward[1].push_back(side2.getForward());
+}
+
+inline SGSide JoinBatch::getSide(int side, size_t i) const
+{
+  return SGSide(SGPosition(seqIDs[side][i], positions[side][i]),
+                forward[side][i] != 0);
+}
+
+inline SGJoin JoinBatch::getJoin(size_t i) const
+{
+  return SGJoin(getSide(0, i), getSide(1, i));
+}
+
 template <typename T> inline
 T JSON2SG::extractStringVal(const rapidjson::Value& val, const char* field)
 {
@@ -99,16 +285,56 @@ T JSON2SG::extractStringVal(const rapidjson::Value& val, const char* field)
                                "Error parsing JSON field: ") + field);
   }
   const rapidjson::Value& v = val[field];
-  if (!v.IsString())
+  T ret;
+  if (!v.IsString() ||
+      convertString(v.GetString(), v.GetStringLength(), ret) == false)
   {
     throw std::runtime_error(std::string(
                                "Error parsing JSON field: ") + field);
   }
-  std::stringstream ss;
-  ss << v.GetString();
-  T ret;
-  ss >> ret;
   return ret;
 }
 
+template <typename T> inline
+bool JSON2SG::convertString(const char* str, size_t length, T& out)
+{
+  const char* end = str + length;
+  // leading space was skipped by the stringstream we used to use
+  while (str != end && isspace((unsigned char)*str))
+  {
+    ++str;
+  }
+  bool negative = str != end && *str == '-';
+  if (str != end && (*str == '-' || *str == '+'))
+  {
+    ++str;
+  }
+  if (str == end || (negative && !std::numeric_limits<T>::is_signed))
+  {
+    return false;
+  }
+  // the magnitude can be one more than the max for negative numbers
+  unsigned long long limit = 
+     (unsigned long long)std::numeric_limits<T>::max() + (negative ? 1 : 0);
+  unsigned long long value = 0;
+  for (; str != end; ++str)
+  {
+    unsigned digit = (unsigned char)*str - '0';
+    if (digit > 9 || value > (limit - digit) / 10)
+    {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  out = negative ? (T)(-(long long)(value - 1) - 1) : (T)value;
+  return true;
+}
+
+inline bool JSON2SG::convertString(const char* str, size_t length,
+                                   std::string& out)
+{
+  out.assign(str, length);
+  return true;
+}
+
 #endif
@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+
+#include "responsecache.h"
+
+using namespace std;
+
+const size_t ResponseCache::DefaultMaxBytes = (size_t)1 << 30;
+
+static const char* CacheMagic = "sg2vg-cache 2";
+
+// keys are 64-bit hashes written out in hex
+static const size_t KeyLength = 16;
+
+ResponseCache::ResponseCache() : _maxBytes(DefaultMaxBytes), _bytes(0),
+                                 _hits(0), _misses(0), _stores(0),
+                                 _evictions(0)
+{
+
+}
+
+ResponseCache::~ResponseCache()
+{
+
+}
+
+void ResponseCache::open(const string& directory, size_t maxBytes)
+{
+  close();
+  if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+  {
+    stringstream ss;
+    ss << "Unable to create cache directory " << directory << ": "
+       << strerror(errno);
+    throw runtime_error(ss.str());
+  }
+  DIR* dir = opendir(directory.c_str());
+  if (dir == NULL)
+  {
+    stringstream ss;
+    ss << "Unable to open cache directory " << directory << ": "
+       << strerror(errno);
+    throw runtime_error(ss.str());
+  }
+  _directory = directory;
+  _maxBytes = maxBytes;
+
+  // only look at files that have names like our keys (so temporary
+  // files and anything else in there are left alone)
+  struct dirent* de;
+  while ((de = readdir(dir)) != NULL)
+  {
+    string name = de->d_name;
+    struct stat st;
+    if (name.length() == KeyLength &&
+        name.find_first_not_of("0123456789abcdef") == string::npos &&
+        stat(getPath(name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+    {
+      Entry& entry = _entries[name];
+      entry.size = st.st_size;
+      entry.lastUse = st.st_mtime;
+      _bytes += entry.size;
+    }
+  }
+  closedir(dir);
+
+  evict();
+}
+
+void ResponseCache::close()
+{
+  _directory.clear();
+  _entries.clear();
+  _bytes = 0;
+}
+
+bool ResponseCache::load(const string& url, const string& postData,
+                         string& outResponse, long* outHttpCode)
+{
+  assert(isOpen());
+  string key = getKey(url, postData);
+  map<string, Entry>::iterator i = _entries.find(key);
+  long httpCode = 0;
+  if (i == _entries.end() ||
+      readEntry(getPath(key), url, postData, outResponse, httpCode) == false)
+  {
+    ++_misses;
+    return false;
+  }
+  // bump modification time so LRU order survives to the next run
+  i->second.lastUse = time(NULL);
+  utime(getPath(key).c_str(), NULL);
+  if (outHttpCode != NULL)
+  {
+    *outHttpCode = httpCode;
+  }
+  ++_hits;
+  return true;
+}
+
+void ResponseCache::store(const string& url, const string& postData,
+                          const char* response, size_t length, long httpCode)
+{
+  assert(isOpen());
+  string key = getKey(url, postData);
+  string path = getPath(key);
+
+  // write somewhere else first so nobody ever reads half a file
+  stringstream tempPath;
+  tempPath << path << "." << getpid() << ".tmp";
+  size_t size = writeEntry(tempPath.str(), url, postData, response, length,
+                           httpCode);
+  if (size == 0 || rename(tempPath.str().c_str(), path.c_str()) != 0)
+  {
+    // not worth failing the download over
+    remove(tempPath.str().c_str());
+    return;
+  }
+
+  map<string, Entry>::iterator i = _entries.find(key);
+  if (i != _entries.end())
+  {
+    _bytes -= i->second.size;
+  }
+  Entry& entry = _entries[key];
+  entry.size = size;
+  entry.lastUse = time(NULL);
+  _bytes += size;
+  ++_stores;
+
+  evict();
+}
+
+string ResponseCache::getKey(const string& url, const string& postData)
+{
+  // 64-bit FNV-1a
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < url.length(); ++i)
+  {
+    hash = (hash ^ (unsigned char)url[i]) * 1099511628211ULL;
+  }
+  // separator so url/body boundary matters
+  hash = (hash ^ 0xff) * 1099511628211ULL;
+  for (size_t i = 0; i < postData.length(); ++i)
+  {
+    hash = (hash ^ (unsigned char)postData[i]) * 1099511628211ULL;
+  }
+  char buf[KeyLength + 1];
+  snprintf(buf, sizeof(buf), "%016llx", hash);
+  return buf;
+}
+
+bool ResponseCache::readEntry(const string& path, const string& url,
+                              const string& postData, string& outResponse,
+                              long& outHttpCode)
+{
+  ifstream file(path.c_str(), ios::in | ios::binary);
+  if (!file)
+  {
+    return false;
+  }
+  string magic;
+  size_t urlLength, postLength, responseLength;
+  if (!getline(file, magic) || magic != CacheMagic ||
+      !(file >> urlLength >> postLength >> responseLength >> outHttpCode) ||
+      file.get() != '\n' ||
+      urlLength != url.length() || postLength != postData.length())
+  {
+    return false;
+  }
+  string buf(urlLength + postLength, '\0');
+  if (!buf.empty() && !file.read(&buf[0], buf.length()))
+  {
+    return false;
+  }
+  if (buf.compare(0, urlLength, url) != 0 ||
+      buf.compare(urlLength, postLength, postData) != 0)
+  {
+    return false;
+  }
+  outResponse.resize(responseLength);
+  if (responseLength > 0 && !file.read(&outResponse[0], responseLength))
+  {
+    return false;
+  }
+  return true;
+}
+
+size_t ResponseCache::writeEntry(const string& path, const string& url,
+                                 const string& postData,
+                                 const char* response, size_t length,
+                                 long httpCode)
+{
+  ofstream file(path.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!file)
+  {
+    return 0;
+  }
+  file << CacheMagic << "\n"
+       << url.length() << " " << postData.length() << " " << length << " "
+       << httpCode << "\n";
+  file.write(url.data(), url.length());
+  file.write(postData.data(), postData.length());
+  file.write(response, length);
+  size_t size = file.tellp();
+  file.close();
+  return file ? size : 0;
+}
+
+string ResponseCache::getPath(const string& key) const
+{
+  return _directory + "/" + key;
+}
+
+void ResponseCache::evict()
+{
+  if (_bytes <= _maxBytes)
+  {
+    return;
+  }
+
+  // go down to 90% so we're not back here after every store
+  vector<pair<time_t, string> > lru;
+  lru.reserve(_entries.size());
+  for (map<string, Entry>::iterator i = _entries.begin(); i != _entries.end();
+       ++i)
+  {
+    lru.push_back(pair<time_t, string>(i->second.lastUse, i->first));
+  }
+  sort(lru.begin(), lru.end());
+  size_t target = _maxBytes / 10 * 9;
+  for (size_t i = 0; i < lru.size() && _bytes > target; ++i)
+  {
+    map<string, Entry>::iterator j = _entries.find(lru[i].second);
+    remove(getPath(j->first).c_str());
+    _bytes -= j->second.size;
+    _entries.erase(j);
+    ++_evictions;
+  }
+}
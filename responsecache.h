@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#ifndef _RESPONSECACHE_H
+#define _RESPONSECACHE_H
+
+#include <string>
+#include <map>
+#include <ctime>
+#include <stdexcept>
+
+
+/**
+Persistent on-disk cache of server responses, so that converting the
+same graph again doesn't need to download anything.  The same format is
+used for the archives that Download records and replays.  Since the POST
+options we send are deterministic, a request is identified by its URL
+and body, and the hash of these is used as the file name of its
+response in the cache directory.  The URL and body are also stored in
+the file and checked on load, so a hash collision is just a miss.
+
+Each file looks like
+   sg2vg-cache 2
+   <url length> <body length> <response length> <http code>
+   <url><body><response>
+
+The total size of the directory is kept under a cap by deleting the
+least recently used files (by modification time, which gets bumped on
+every hit).  Files are written to a temporary name then renamed, so
+several processes can share a directory.
+
+Not thread safe: Download only calls it with its _cacheMutex held.
+*/
+class ResponseCache
+{
+public:
+
+   static const size_t DefaultMaxBytes;
+
+   ResponseCache();
+   ~ResponseCache();
+
+   /** Use directory (which is created if it doesn't exist) for the
+    * cache, and scan what's already in there. */
+   void open(const std::string& directory,
+             size_t maxBytes = DefaultMaxBytes);
+
+   /** Stop using the cache directory */
+   void close();
+
+   bool isOpen() const;
+
+   /** Look up the response to a request.  returns true (and sets
+    * outResponse and outHttpCode) if found */
+   bool load(const std::string& url, const std::string& postData,
+             std::string& outResponse, long* outHttpCode = NULL);
+
+   /** Add the response to a request to the cache, evicting old
+    * responses if over the size limit */
+   void store(const std::string& url, const std::string& postData,
+              const char* response, size_t length, long httpCode = 200);
+
+   /** Name of the file a request's response gets stored in */
+   static std::string getKey(const std::string& url,
+                             const std::string& postData);
+
+   /** Read a cache file.  returns false if it's missing, malformed, or
+    * not for the given request */
+   static bool readEntry(const std::string& path, const std::string& url,
+                         const std::string& postData,
+                         std::string& outResponse, long& outHttpCode);
+
+   /** Write a cache file.  returns the number of bytes written, or 0 if
+    * it failed */
+   static size_t writeEntry(const std::string& path, const std::string& url,
+                            const std::string& postData,
+                            const char* response, size_t length,
+                            long httpCode);
+
+   size_t getHits() const;
+   size_t getMisses() const;
+   size_t getStores() const;
+   size_t getEvictions() const;
+   /** total size of all files in cache */
+   size_t getBytes() const;
+
+protected:
+
+   struct Entry {
+      size_t size;
+      time_t lastUse;
+   };
+
+   std::string getPath(const std::string& key) const;
+
+   /** Delete least recently used entries until comfortably under the
+    * size limit */
+   void evict();
+
+   std::string _directory;
+   size_t _maxBytes;
+   std::map<std::string, Entry> _entries;
+   size_t _bytes;
+   size_t _hits;
+   size_t _misses;
+   size_t _stores;
+   size_t _evictions;
+};
+
+inline bool ResponseCache::isOpen() const
+{
+  return !_directory.empty();
+}
+
+inline size_t ResponseCache::getHits() const
+{
+  return _hits;
+}
+
+inline size_t ResponseCache::getMisses() const
+{
+  return _misses;
+}
+
+inline size_t ResponseCache::getStores() const
+{
+  return _stores;
+}
+
+inline size_t ResponseCache::getEvictions() const
+{
+  return _evictions;
+}
+
+inline size_t ResponseCache::getBytes() const
+{
+  return _bytes;
+}
+
+#endif
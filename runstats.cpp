@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include "runstats.h"
+
+using namespace std;
+using namespace rapidjson;
+
+// upper bounds (in seconds) of latency histogram buckets.  the last
+// bucket catches everything else.
+static const double HistogramBounds[] = {0.001, 0.002, 0.005, 0.01, 0.02,
+                                         0.05, 0.1, 0.2, 0.5, 1., 2., 5.,
+                                         10., 30., 60.};
+static const int NumHistogramBounds =
+  sizeof(HistogramBounds) / sizeof(double);
+
+/** value at fraction q of sorted values (nearest rank) */
+static double percentile(const vector<double>& sorted, double q)
+{
+  if (sorted.empty())
+  {
+    return 0.;
+  }
+  size_t rank = (size_t)ceil(q * sorted.size());
+  return sorted[min(max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+RunStats::RunStats()
+{
+  clear();
+}
+
+RunStats::~RunStats()
+{
+
+}
+
+void RunStats::clear()
+{
+  lock_guard<mutex> lock(_mutex);
+  _startTime = now();
+  _endpoints.clear();
+  _searches.clear();
+  _phases.clear();
+}
+
+double RunStats::now()
+{
+  return chrono::duration<double>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+string RunStats::getEndpoint(const string& url, bool post)
+{
+  // skip scheme and host
+  size_t pathStart = url.find("://");
+  pathStart = url.find('/', pathStart == string::npos ? 0 : pathStart + 3);
+  string path = pathStart == string::npos ? "/" : url.substr(pathStart);
+
+  // replace the numeric path elements (ie ids) so the same kind of
+  // request always maps to the same endpoint
+  string endpoint = post ? "POST " : "GET ";
+  size_t i = 0;
+  while (i < path.length())
+  {
+    size_t next = path.find('/', i + 1);
+    if (next == string::npos)
+    {
+      next = path.length();
+    }
+    string element = path.substr(i, next - i);
+    if (element.length() > 1 &&
+        element.find_first_not_of("0123456789", 1) == string::npos)
+    {
+      element = "/{id}";
+    }
+    endpoint += element;
+    i = next;
+  }
+  return endpoint;
+}
+
+RunStats::EndpointStats& RunStats::getEndpointStats(const string& url,
+                                                     bool post)
+{
+  string endpoint = getEndpoint(url, post);
+  map<string, EndpointStats>::iterator i = _endpoints.find(endpoint);
+  if (i == _endpoints.end())
+  {
+    EndpointStats stats;
+    stats.requests = 0;
+    stats.cacheHits = 0;
+    stats.retries = 0;
+    stats.bytesReceived = 0;
+    stats.bytesDecoded = 0;
+    stats.connections = 0;
+    i = _endpoints.insert(pair<string, EndpointStats>(endpoint, stats)).first;
+  }
+  return i->second;
+}
+
+void RunStats::addRequest(const string& url, bool post, double seconds,
+                          size_t bytesReceived, size_t bytesDecoded,
+                          size_t newConnections)
+{
+  lock_guard<mutex> lock(_mutex);
+  EndpointStats& stats = getEndpointStats(url, post);
+  ++stats.requests;
+  stats.bytesReceived += bytesReceived;
+  stats.bytesDecoded += bytesDecoded;
+  stats.connections += newConnections;
+  stats.latencies.push_back(seconds);
+}
+
+void RunStats::addCacheHit(const string& url, bool post)
+{
+  lock_guard<mutex> lock(_mutex);
+  ++getEndpointStats(url, post).cacheHits;
+}
+
+void RunStats::addRetry(const string& url, bool post)
+{
+  lock_guard<mutex> lock(_mutex);
+  ++getEndpointStats(url, post).retries;
+}
+
+RunStats::SearchStats& RunStats::getSearchStats(const string& search)
+{
+  map<string, SearchStats>::iterator i = _searches.find(search);
+  if (i == _searches.end())
+  {
+    SearchStats stats;
+    stats.pages = 0;
+    stats.records = 0;
+    stats.parseSeconds = 0.;
+    stats.pageSize = 0;
+    i = _searches.insert(pair<string, SearchStats>(search, stats)).first;
+  }
+  return i->second;
+}
+
+void RunStats::addParse(const string& search, double seconds, size_t records)
+{
+  lock_guard<mutex> lock(_mutex);
+  SearchStats& stats = getSearchStats(search);
+  ++stats.pages;
+  stats.records += records;
+  stats.parseSeconds += seconds;
+}
+
+void RunStats::addParseSeconds(const string& search, double seconds)
+{
+  lock_guard<mutex> lock(_mutex);
+  getSearchStats(search).parseSeconds += seconds;
+}
+
+void RunStats::setPageSize(const string& search, int pageSize)
+{
+  lock_guard<mutex> lock(_mutex);
+  getSearchStats(search).pageSize = pageSize;
+}
+
+void RunStats::addPhase(const string& phase, double seconds)
+{
+  lock_guard<mutex> lock(_mutex);
+  _phases[phase] += seconds;
+}
+
+void RunStats::writeJSON(ostream& os) const
+{
+  lock_guard<mutex> lock(_mutex);
+  StringBuffer buffer;
+  Writer<StringBuffer> writer(buffer);
+
+  writer.StartObject();
+  writer.Key("seconds");
+  writer.Double(now() - _startTime);
+
+  size_t requests = 0, cacheHits = 0, retries = 0, bytesReceived = 0,
+     bytesDecoded = 0, connections = 0;
+  writer.Key("endpoints");
+  writer.StartObject();
+  for (map<string, EndpointStats>::const_iterator i = _endpoints.begin();
+       i != _endpoints.end(); ++i)
+  {
+    const EndpointStats& stats = i->second;
+    requests += stats.requests;
+    cacheHits += stats.cacheHits;
+    retries += stats.retries;
+    bytesReceived += stats.bytesReceived;
+    bytesDecoded += stats.bytesDecoded;
+    connections += stats.connections;
+
+    writer.Key(i->first.c_str());
+    writer.StartObject();
+    writer.Key("requests");
+    writer.Uint64(stats.requests);
+    writer.Key("cacheHits");
+    writer.Uint64(stats.cacheHits);
+    writer.Key("retries");
+    writer.Uint64(stats.retries);
+    writer.Key("connections");
+    writer.Uint64(stats.connections);
+    writer.Key("bytesReceived");
+    writer.Uint64(stats.bytesReceived);
+    writer.Key("bytesDecompressed");
+    writer.Uint64(stats.bytesDecoded);
+
+    vector<double> sorted(stats.latencies);
+    sort(sorted.begin(), sorted.end());
+    double total = 0.;
+    for (size_t j = 0; j < sorted.size(); ++j)
+    {
+      total += sorted[j];
+    }
+    writer.Key("latency");
+    writer.StartObject();
+    writer.Key("min");
+    writer.Double(sorted.empty() ? 0. : sorted.front());
+    writer.Key("mean");
+    writer.Double(sorted.empty() ? 0. : total / sorted.size());
+    writer.Key("p50");
+    writer.Double(percentile(sorted, 0.5));
+    writer.Key("p95");
+    writer.Double(percentile(sorted, 0.95));
+    writer.Key("p99");
+    writer.Double(percentile(sorted, 0.99));
+    writer.Key("max");
+    writer.Double(sorted.empty() ? 0. : sorted.back());
+    // number of requests with latency <= le (and more than the previous
+    // bucket).  empty buckets are left out
+    writer.Key("histogram");
+    writer.StartArray();
+    size_t j = 0;
+    for (int b = 0; b <= NumHistogramBounds; ++b)
+    {
+      size_t count = 0;
+      for (; j < sorted.size() && (b == NumHistogramBounds ||
+                                   sorted[j] <= HistogramBounds[b]); ++j)
+      {
+        ++count;
+      }
+      if (count > 0)
+      {
+        writer.StartObject();
+        writer.Key("le");
+        if (b < NumHistogramBounds)
+        {
+          writer.Double(HistogramBounds[b]);
+        }
+        else
+        {
+          writer.Null();
+        }
+        writer.Key("count");
+        writer.Uint64(count);
+        writer.EndObject();
+      }
+    }
+    writer.EndArray();
+    writer.EndObject();
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  writer.Key("requests");
+  writer.StartObject();
+  writer.Key("requests");
+  writer.Uint64(requests);
+  writer.Key("cacheHits");
+  writer.Uint64(cacheHits);
+  writer.Key("retries");
+  writer.Uint64(retries);
+  writer.Key("connections");
+  writer.Uint64(connections);
+  writer.Key("bytesReceived");
+  writer.Uint64(bytesReceived);
+  writer.Key("bytesDecompressed");
+  writer.Uint64(bytesDecoded);
+  writer.EndObject();
+
+  writer.Key("searches");
+  writer.StartObject();
+  for (map<string, SearchStats>::const_iterator i = _searches.begin();
+       i != _searches.end(); ++i)
+  {
+    const SearchStats& stats = i->second;
+    writer.Key(i->first.c_str());
+    writer.StartObject();
+    writer.Key("pages");
+    writer.Uint64(stats.pages);
+    writer.Key("records");
+    writer.Uint64(stats.records);
+    writer.Key("pageSize");
+    writer.Int(stats.pageSize);
+    writer.Key("parseSeconds");
+    writer.Double(stats.parseSeconds);
+    writer.Key("parseRecordsPerSecond");
+    writer.Double(stats.parseSeconds > 0. ?
+                  stats.records / stats.parseSeconds : 0.);
+    map<string, double>::const_iterator phase = _phases.find(i->first);
+    if (phase != _phases.end())
+    {
+      writer.Key("recordsPerSecond");
+      writer.Double(phase->second > 0. ? stats.records / phase->second : 0.);
+    }
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  writer.Key("phases");
+  writer.StartObject();
+  for (map<string, double>::const_iterator i = _phases.begin();
+       i != _phases.end(); ++i)
+  {
+    writer.Key(i->first.c_str());
+    writer.Double(i->second);
+  }
+  writer.EndObject();
+
+  writer.EndObject();
+
+  os << buffer.GetString() << std::endl;
+}
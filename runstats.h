@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#ifndef _RUNSTATS_H
+#define _RUNSTATS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+
+/**
+Timings and counters for a whole download, so we can tell whether a
+slow run is waiting on the network, the server or the parser.
+
+Download adds every request it completes, by endpoint (method plus
+URL path, with numeric ids replaced by {id}), and SGClient adds the
+time it spends parsing each page of a search and the wall time of each
+phase of downloadGraph().  writeJSON() dumps it all, with latency
+percentiles and histograms per endpoint and records per second per
+search.
+
+Thread safe.
+*/
+class RunStats
+{
+public:
+
+   RunStats();
+   ~RunStats();
+
+   /** forget everything */
+   void clear();
+
+   /** seconds since some fixed point, for timing things */
+   static double now();
+
+   /** endpoint name used for a request */
+   static std::string getEndpoint(const std::string& url, bool post);
+
+   /** a request to url completed (after seconds).  bytesReceived is the
+    * (possibly compressed) size on the wire, bytesDecoded the size after
+    * decompression. */
+   void addRequest(const std::string& url, bool post, double seconds,
+                   size_t bytesReceived, size_t bytesDecoded,
+                   size_t newConnections);
+
+   /** a request to url was served from the cache */
+   void addCacheHit(const std::string& url, bool post);
+
+   /** a request to url failed and will be retried */
+   void addRetry(const std::string& url, bool post);
+
+   /** a page of records was parsed from a search in seconds */
+   void addParse(const std::string& search, double seconds, size_t records);
+
+   /** more time was spent parsing the records of a search (ex the 
+    * alleles found by a page of the allele search) */
+   void addParseSeconds(const std::string& search, double seconds);
+
+   /** the page size a search ended up using */
+   void setPageSize(const std::string& search, int pageSize);
+
+   /** a phase of the download (eg "sequences") took seconds in total */
+   void addPhase(const std::string& phase, double seconds);
+
+   /** write everything as a JSON object */
+   void writeJSON(std::ostream& os) const;
+
+protected:
+
+   struct EndpointStats {
+      size_t requests;
+      size_t cacheHits;
+      size_t retries;
+      size_t bytesReceived;
+      size_t bytesDecoded;
+      size_t connections;
+      std::vector<double> latencies;
+   };
+
+   struct SearchStats {
+      size_t pages;
+      size_t records;
+      double parseSeconds;
+      int pageSize;
+   };
+
+   EndpointStats& getEndpointStats(const std::string& url, bool post);
+   SearchStats& getSearchStats(const std::string& search);
+
+   double _startTime;
+   std::map<std::string, EndpointStats> _endpoints;
+   std::map<std::string, SearchStats> _searches;
+   std::map<std::string, double> _phases;
+   mutable std::mutex _mutex;
+};
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#include <limits>
+#include <stdexcept>
+
+#include "seqidmap.h"
+
+using namespace std;
+
+const size_t SeqIDMap::DenseFactor = 4;
+const size_t SeqIDMap::MinDenseSize = 1024;
+const sg_int_t SeqIDMap::EmptyKey = numeric_limits<sg_int_t>::min();
+
+SeqIDMap::SeqIDMap()
+{
+  clear();
+}
+
+SeqIDMap::~SeqIDMap()
+{
+
+}
+
+void SeqIDMap::clear()
+{
+  _toOriginal.clear();
+  _fromOriginal.clear();
+  _slots.clear();
+  _bits = 0;
+  _size = 0;
+  _dense = true;
+  _identity = true;
+}
+
+void SeqIDMap::insert(sg_int_t originalID, sg_int_t sgID)
+{
+  if (originalID == EmptyKey || sgID < 0)
+  {
+    throw runtime_error("Sequence ID out of range");
+  }
+  if (getSG(originalID) != -1 || getOriginal(sgID) != -1)
+  {
+    return;
+  }
+  if (sgID >= (sg_int_t)_toOriginal.size())
+  {
+    _toOriginal.resize(max((size_t)sgID + 1, _toOriginal.size() * 2), -1);
+  }
+  _toOriginal[sgID] = originalID;
+  ++_size;
+  _identity = _identity && originalID == sgID;
+
+  if (_dense && !fitsDense(originalID))
+  {
+    makeSparse();
+  }
+  if (_dense)
+  {
+    if (originalID >= (sg_int_t)_fromOriginal.size())
+    {
+      _fromOriginal.resize(max((size_t)originalID + 1,
+                               _fromOriginal.size() * 2), -1);
+    }
+    _fromOriginal[originalID] = sgID;
+  }
+  else
+  {
+    insertHash(originalID, sgID);
+  }
+}
+
+bool SeqIDMap::fitsDense(sg_int_t originalID) const
+{
+  return originalID >= 0 &&
+     (size_t)originalID < max(MinDenseSize, _size * DenseFactor);
+}
+
+void SeqIDMap::makeSparse()
+{
+  _dense = false;
+  int bits = 4;
+  while (((size_t)1 << bits) < _size * 2)
+  {
+    ++bits;
+  }
+  rehash(bits);
+  for (size_t i = 0; i < _fromOriginal.size(); ++i)
+  {
+    if (_fromOriginal[i] != -1)
+    {
+      insertHash(i, _fromOriginal[i]);
+    }
+  }
+  vector<sg_int_t>().swap(_fromOriginal);
+}
+
+void SeqIDMap::rehash(int bits)
+{
+  vector<Slot> slots(1 << bits);
+  for (size_t i = 0; i < slots.size(); ++i)
+  {
+    slots[i].original = EmptyKey;
+    slots[i].sg = -1;
+  }
+  slots.swap(_slots);
+  _bits = bits;
+  for (size_t i = 0; i < slots.size(); ++i)
+  {
+    if (slots[i].original != EmptyKey)
+    {
+      insertHash(slots[i].original, slots[i].sg);
+    }
+  }
+}
+
+void SeqIDMap::insertHash(sg_int_t originalID, sg_int_t sgID)
+{
+  // (_size already counts this one)
+  if (_size * 2 > _slots.size())
+  {
+    rehash(_bits + 1);
+  }
+  size_t mask = _slots.size() - 1;
+  size_t i = getSlot(originalID);
+  while (_slots[i].original != EmptyKey)
+  {
+    i = (i + 1) & mask;
+  }
+  _slots[i].original = originalID;
+  _slots[i].sg = sgID;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#ifndef _SEQIDMAP_H
+#define _SEQIDMAP_H
+
+#include <vector>
+#include <cstdint>
+
+#include "sidegraph.h"
+
+/**
+Two way map between the sequence ids of the graph server and the ones
+the SideGraph gave the sequences (which are always [0, n)).  Every
+join and path segment is looked up, so both directions are flat
+arrays rather than trees:
+
+sg -> original is just a vector indexed by sg id.  original -> sg is
+a vector indexed by original id too, as long as the server's ids are
+reasonably compact (non-negative and less than a few times the number
+of sequences).  As soon as one isn't, it switches to an open addressing
+hash table (linear probing, kept at most half full).
+
+Servers that number their sequences 0, 1, 2... in the order they're
+returned get the same ids in the side graph, in which case the map is
+the identity and there's nothing to remap (see isIdentity()).
+
+Not thread safe for writing, but any number of threads can look up at
+once.
+*/
+class SeqIDMap
+{
+public:
+
+   SeqIDMap();
+   ~SeqIDMap();
+
+   void clear();
+
+   /** Add a mapping (ignored if either id is already mapped, like
+    * inserting into a std::map) */
+   void insert(sg_int_t originalID, sg_int_t sgID);
+
+   /** returns -1 if not found */
+   sg_int_t getOriginal(sg_int_t sgID) const;
+   /** returns -1 if not found */
+   sg_int_t getSG(sg_int_t originalID) const;
+
+   size_t size() const;
+
+   /** is original -> sg still a plain array? */
+   bool isDense() const;
+
+   /** is every original id the same as its sg id? */
+   bool isIdentity() const;
+
+   /** The dense table is used as long as original ids are less than
+    * DenseFactor times the number of sequences (or MinDenseSize) */
+   static const size_t DenseFactor;
+   static const size_t MinDenseSize;
+
+protected:
+
+   struct Slot {
+      sg_int_t original;
+      sg_int_t sg;
+   };
+
+   // key of an unused hash slot
+   static const sg_int_t EmptyKey;
+
+   bool fitsDense(sg_int_t originalID) const;
+   size_t getSlot(sg_int_t originalID) const;
+   /** move everything from the dense table into the hash table */
+   void makeSparse();
+   /** (re)allocate the hash table with 2^bits slots */
+   void rehash(int bits);
+   void insertHash(sg_int_t originalID, sg_int_t sgID);
+   sg_int_t findHash(sg_int_t originalID) const;
+
+   std::vector<sg_int_t> _toOriginal;
+   std::vector<sg_int_t> _fromOriginal;
+   std::vector<Slot> _slots;
+   // (hash is the top _bits bits of the Fibonacci product)
+   int _bits;
+   size_t _size;
+   bool _dense;
+   bool _identity;
+};
+
+inline sg_int_t SeqIDMap::getOriginal(sg_int_t sgID) const
+{
+  if (sgID < 0 || sgID >= (sg_int_t)_toOriginal.size())
+  {
+    return -1;
+  }
+  return _toOriginal[sgID];
+}
+
+inline sg_int_t SeqIDMap::getSG(sg_int_t originalID) const
+{
+  if (_dense)
+  {
+    if (originalID < 0 || originalID >= (sg_int_t)_fromOriginal.size())
+    {
+      return -1;
+    }
+    return _fromOriginal[originalID];
+  }
+  return findHash(originalID);
+}
+
+inline size_t SeqIDMap::size() const
+{
+  return _size;
+}
+
+inline bool SeqIDMap::isDense() const
+{
+  return _dense;
+}
+
+inline bool SeqIDMap::isIdentity() const
+{
+  return _identity;
+}
+
+inline size_t SeqIDMap::getSlot(sg_int_t originalID) const
+{
+  return ((uint64_t)originalID * 0x9E3779B97F4A7C15ULL) >> (64 - _bits);
+}
+
+inline sg_int_t SeqIDMap::findHash(sg_int_t originalID) const
+{
+  size_t mask = _slots.size() - 1;
+  for (size_t i = getSlot(originalID); ; i = (i + 1) & mask)
+  {
+    const Slot& slot = _slots[i];
+    if (slot.original == originalID)
+    {
+      return slot.sg;
+    }
+    if (slot.original == EmptyKey)
+    {
+      return -1;
+    }
+  }
+}
+
+#endif
@@ -10,12 +10,17 @@
 #include <cassert>
 #include <fstream>
 #include <cstdio>
+#include <memory>
+#include <climits>
+#include <cerrno>
+#include <limits>
 #include <getopt.h>
 
 #include "sgclient.h"
 #include "download.h"
 #include "side2seq.h"
 #include "sg2vgjson.h"
+#include "snapshot.h"
 
 using namespace std;
 
@@ -23,6 +28,7 @@ void help(char** argv)
 {
   cerr << "ga2vg: Convert GA4GH graph server to VG (JSON printed to stdout)\n"
        << "\nusage: " << argv[0] << " <URL> [options]\n"
+       << "       " << argv[0] << " -i <snapshot> [options]\n"
        << "args:\n"
        << "    URL:  Input GA4GH graph server URL to convert\n"
        << "          (Important: URL must end with version, ex. /v0.6.g)\n"
@@ -30,12 +36,106 @@ void help(char** argv)
        << "    -h, --help         \n"
        << "    -p, --pageSize     Number of records per POST request "
        << "(default=" << SGClient::DefaultPageSize << ").\n"
+       << "    -A, --adaptive     Resize the pages of each search as they "
+       << "arrive, starting at\n"
+       << "                       pageSize, to aim for the targets below.\n"
+       << "    -t, --target-time  Seconds a page should take to download "
+       << "with -A (default="
+       << SGClient::DefaultTargetSeconds << ").\n"
+       << "                       Ignored with -C, -w or -y, so that pages "
+       << "come out the\n"
+       << "                       same every run and are found in the cache "
+       << "or archive.\n"
+       << "    -b, --target-size  Size (MB) a page should be with -A "
+       << "(default=" << (SGClient::DefaultTargetBytes >> 20) << ").\n"
        << "    -u, --upper        Write all sequences in upper case.\n"
        << "    -a, --paths        Add a VG path for each input sequence.\n"
        << "    -n, --no-paths     Don't write any paths.\n"
+       << "    -k, --keep-ids     Use the server's sequence IDs as node IDs "
+       << "(only possible if\n"
+       << "                       no sequence had to be cut).\n"
+       << "    -c, --connections  Maximum number of HTTP requests to run in "
+       << "parallel (default=" << Download::DefaultMaxInFlight << ").\n"
+       << "    -f, --fanout       Number of pages of each search to request "
+       << "at once (default=" << SGClient::DefaultFanout << ").\n"
+       << "    -l, --pipeline     Download pages in a background thread while "
+       << "parsing.\n"
+       << "    -P, --parallel     Download References, Sequences, Joins and "
+       << "allele paths at the same time.\n"
+       << "    -j, --parse-threads  Number of threads to parse pages with "
+       << "(default=0: parse\n"
+       << "                       in the main thread as they download).\n"
+       << "    -r, --retries      Number of times to retry a failed request "
+       << "(default=" << Download::DefaultMaxRetries << ").\n"
+       << "    -d, --stall-time   Seconds a request can go without receiving "
+       << "anything before\n"
+       << "                       it's retried (default=0: wait forever).\n"
+       << "    -C, --cache-dir    Directory to cache server responses in, so "
+       << "they don't need\n"
+       << "                       to be downloaded again next time.\n"
+       << "    -S, --cache-size   Maximum size of the cache directory in MB "
+       << "(default=" << (ResponseCache::DefaultMaxBytes >> 20) << ").\n"
+       << "    -w, --record       Save all server responses in given "
+       << "directory.\n"
+       << "    -y, --replay       Don't connect to server, but use responses "
+       << "saved with -w\n"
+       << "                       in given directory.\n"
+       << "    -L, --latency      Seconds each replayed request takes "
+       << "(default=0).\n"
+       << "    -B, --bandwidth    Download speed (MB/s) of replayed requests "
+       << "(default=unlimited).\n"
+       << "    -T, --stats        Write timings and counts of requests, "
+       << "parsing etc. as JSON\n"
+       << "                       to given file.\n"
+       << "    -z, --no-compress  Don't ask server for compressed "
+       << "responses.\n"
+       << "    -s, --save-snapshot  Save the downloaded graph to given file, "
+       << "so it can be\n"
+       << "                       converted again with -i.\n"
+       << "    -i, --load-snapshot  Convert a graph saved with -s instead of "
+       << "downloading\n"
+       << "                       one (URL isn't needed).\n"
        << endl;
 }
 
+/** Value of a numeric option (optarg), which must be a whole number 
+ * in [minValue, maxValue].  Prints the help and exits if it isn't */
+static long getIntOption(char** argv, int option, long minValue,
+                         long maxValue)
+{
+  char* end = NULL;
+  errno = 0;
+  long value = strtol(optarg, &end, 10);
+  if (end == optarg || *end != '\0' || errno != 0 ||
+      value < minValue || value > maxValue)
+  {
+    cerr << "Error: Invalid value \"" << optarg << "\" for -"
+         << (char)option << "\n" << endl;
+    help(argv);
+    exit(1);
+  }
+  return value;
+}
+
+/** Same for a real number */
+static double getRealOption(char** argv, int option, double minValue,
+                            double maxValue)
+{
+  char* end = NULL;
+  errno = 0;
+  double value = strtod(optarg, &end);
+  // (written so that nan fails too)
+  if (end == optarg || *end != '\0' || errno != 0 ||
+      !(value >= minValue && value <= maxValue))
+  {
+    cerr << "Error: Invalid value \"" << optarg << "\" for -"
+         << (char)option << "\n" << endl;
+    help(argv);
+    exit(1);
+  }
+  return value;
+}
+
 int main(int argc, char** argv)
 {
   if (argc < 2)
@@ -45,9 +145,30 @@ int main(int argc, char** argv)
   }
 
   int pageSize = SGClient::DefaultPageSize;
+  bool adaptivePageSize = false;
+  double targetSeconds = SGClient::DefaultTargetSeconds;
+  size_t targetBytes = SGClient::DefaultTargetBytes;
   bool upperCase = false;
   bool seqPaths = false;
   bool skipPaths = false;
+  bool keepIDs = false;
+  int connections = Download::DefaultMaxInFlight;
+  int fanout = SGClient::DefaultFanout;
+  bool pipelined = false;
+  bool concurrentPhases = false;
+  int parseThreads = 0;
+  bool compression = true;
+  int retries = Download::DefaultMaxRetries;
+  int stallTimeout = 0;
+  string cacheDir;
+  size_t cacheSize = ResponseCache::DefaultMaxBytes;
+  string recordDir;
+  string replayDir;
+  double replayLatency = 0.;
+  double replayBandwidth = 0.;
+  string statsPath;
+  string saveSnapshotPath;
+  string loadSnapshotPath;
   optind = 1;
   while (true)
   {
@@ -55,12 +176,34 @@ int main(int argc, char** argv)
        {
          {"help", no_argument, 0, 'h'},
          {"page", required_argument, 0, 'p'},
+         {"adaptive", no_argument, 0, 'A'},
+         {"target-time", required_argument, 0, 't'},
+         {"target-size", required_argument, 0, 'b'},
          {"upper", no_argument, 0, 'u'},
          {"paths", no_argument, 0, 'a'},
-         {"no-paths", no_argument, 0, 'n'}
+         {"no-paths", no_argument, 0, 'n'},
+         {"keep-ids", no_argument, 0, 'k'},
+         {"connections", required_argument, 0, 'c'},
+         {"fanout", required_argument, 0, 'f'},
+         {"pipeline", no_argument, 0, 'l'},
+         {"parallel", no_argument, 0, 'P'},
+         {"parse-threads", required_argument, 0, 'j'},
+         {"retries", required_argument, 0, 'r'},
+         {"stall-time", required_argument, 0, 'd'},
+         {"cache-dir", required_argument, 0, 'C'},
+         {"cache-size", required_argument, 0, 'S'},
+         {"record", required_argument, 0, 'w'},
+         {"replay", required_argument, 0, 'y'},
+         {"latency", required_argument, 0, 'L'},
+         {"bandwidth", required_argument, 0, 'B'},
+         {"stats", required_argument, 0, 'T'},
+         {"no-compress", no_argument, 0, 'z'},
+         {"save-snapshot", required_argument, 0, 's'},
+         {"load-snapshot", required_argument, 0, 'i'},
+         {0, 0, 0, 0}
        };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "hp:uan", long_options, &option_index);
+    int c = getopt_long(argc, argv, "hp:At:b:uankc:f:lPj:r:d:C:S:w:y:L:B:T:zs:i:", long_options, &option_index);
 
     if (c == -1)
     {
@@ -74,7 +217,19 @@ int main(int argc, char** argv)
       help(argv);
       exit(1);
     case 'p':
-      pageSize = atoi(optarg);
+      pageSize = getIntOption(argv, c, 1, INT_MAX);
+      break;
+    case 'A':
+      adaptivePageSize = true;
+      break;
+    case 't':
+      targetSeconds = getRealOption(argv, c, numeric_limits<double>::min(),
+                                    numeric_limits<double>::max());
+      break;
+    case 'b':
+      targetBytes = (size_t)(getRealOption(argv, c, 1. / (1024 * 1024),
+                                           (double)(SIZE_MAX >> 20)) *
+                             1024. * 1024.);
       break;
     case 'u':
       upperCase = true;
@@ -85,20 +240,107 @@ int main(int argc, char** argv)
     case 'n':
       skipPaths = true;
       break;
+    case 'k':
+      keepIDs = true;
+      break;
+    case 'c':
+      connections = getIntOption(argv, c, 1, INT_MAX);
+      break;
+    case 'f':
+      fanout = getIntOption(argv, c, 1, INT_MAX);
+      break;
+    case 'l':
+      pipelined = true;
+      break;
+    case 'P':
+      concurrentPhases = true;
+      break;
+    case 'j':
+      parseThreads = getIntOption(argv, c, 0, INT_MAX);
+      break;
+    case 'r':
+      retries = getIntOption(argv, c, 0, INT_MAX);
+      break;
+    case 'd':
+      stallTimeout = getIntOption(argv, c, 0, INT_MAX);
+      break;
+    case 'C':
+      cacheDir = optarg;
+      break;
+    case 'S':
+      cacheSize = (size_t)getIntOption(argv, c, 0,
+                                       min((size_t)LONG_MAX,
+                                           SIZE_MAX >> 20)) << 20;
+      break;
+    case 'w':
+      recordDir = optarg;
+      break;
+    case 'y':
+      replayDir = optarg;
+      break;
+    case 'L':
+      replayLatency = getRealOption(argv, c, 0.,
+                                    numeric_limits<double>::max());
+      break;
+    case 'B':
+      replayBandwidth = getRealOption(argv, c, 0., (double)(SIZE_MAX >> 20)) *
+         1024. * 1024.;
+      break;
+    case 'T':
+      statsPath = optarg;
+      break;
+    case 'z':
+      compression = false;
+      break;
+    case 's':
+      saveSnapshotPath = optarg;
+      break;
+    case 'i':
+      loadSnapshotPath = optarg;
+      break;
     default:
       abort();
     }
   }
 
+  if (optind >= argc && loadSnapshotPath.empty())
+  {
+    help(argv);
+    return 1;
+  }
+
   Download::init();
-  
-  string url = argv[optind];
 
   SGClient sgClient;
-  sgClient.setURL(url);
+  if (loadSnapshotPath.empty())
+  {
+    sgClient.setURL(argv[optind]);
+  }
   sgClient.setOS(&cerr);
   sgClient.setPageSize(pageSize);
+  sgClient.setAdaptivePageSize(adaptivePageSize, targetSeconds, targetBytes);
   sgClient.setSkipPaths(skipPaths);
+  sgClient.setConnections(connections);
+  sgClient.setFanout(fanout);
+  sgClient.setPipelined(pipelined);
+  sgClient.setConcurrentPhases(concurrentPhases);
+  sgClient.setParseThreads(parseThreads);
+  sgClient.setUpperCase(upperCase);
+  sgClient.setRetries(retries);
+  sgClient.setStallTimeout(stallTimeout);
+  sgClient.setCompression(compression);
+  if (!cacheDir.empty())
+  {
+    sgClient.setCacheDir(cacheDir, cacheSize);
+  }
+  if (!recordDir.empty())
+  {
+    sgClient.setRecordDir(recordDir);
+  }
+  if (!replayDir.empty())
+  {
+    sgClient.setReplayDir(replayDir, replayLatency, replayBandwidth);
+  }
 
   // ith element is bases for sequence with id i in side graph
   vector<string> bases;
@@ -106,13 +348,49 @@ int main(int argc, char** argv)
   // ith element is <name, segment vector> for allele i
   vector<SGNamedPath> paths;
 
-  const SideGraph* sg = sgClient.downloadGraph(bases, paths);
+  // ith element is the server's id for sequence with id i in side graph
+  vector<sg_int_t> originalIDs;
+
+  const SideGraph* sg;
+  // (declared before converter, so it outlives it)
+  unique_ptr<SideGraph> loadedGraph;
+  double start = RunStats::now();
+  if (!loadSnapshotPath.empty())
+  {
+    cerr << "Loading Side Graph from " << loadSnapshotPath << endl;
+    loadedGraph.reset(GraphSnapshot::load(loadSnapshotPath, bases, paths,
+                                          originalIDs));
+    sg = loadedGraph.get();
+    sgClient.getStats().addPhase("load", RunStats::now() - start);
+  }
+  else
+  {
+    sg = sgClient.downloadGraph(bases, paths);
+    originalIDs.resize(sg->getNumSequences());
+    for (sg_int_t i = 0; i < sg->getNumSequences(); ++i)
+    {
+      originalIDs[i] = sgClient.getOriginalSeqID(i);
+    }
+  }
+
+  if (!saveSnapshotPath.empty())
+  {
+    cerr << "Saving Side Graph to " << saveSnapshotPath << endl;
+    start = RunStats::now();
+    GraphSnapshot::save(saveSnapshotPath, sg, bases, paths, originalIDs);
+    sgClient.getStats().addPhase("save", RunStats::now() - start);
+  }
 
   // convert side graph into sequence graph (which is stored
   cerr << "Converting Side Graph to VG Sequence Graph" << endl;
+  start = RunStats::now();
   Side2Seq converter;
-  converter.init(sg, &bases, &paths, upperCase, seqPaths, "&SG_");
+  // (downloaded bases were already upper-cased, if need be, as they were
+  // parsed, but a snapshot's are however they were saved)
+  converter.init(sg, &bases, &paths, upperCase && loadedGraph,
+                 seqPaths, "&SG_");
   converter.convert();
+  sgClient.getStats().addPhase("convert", RunStats::now() - start);
 
   const SideGraph* outGraph = converter.getOutGraph();
   const vector<string>& outBases = converter.getOutBases();
@@ -122,7 +400,34 @@ int main(int argc, char** argv)
   cerr << "Writing VG JSON to stdout" << endl;
   SG2VGJSON jsonWriter;
   jsonWriter.init(&cout);
+  vector<sg_int_t> nodeIDs;
+  string whyNot;
+  if (keepIDs && SG2VGJSON::getServerNodeIDs(sg, originalIDs, outGraph,
+                                             nodeIDs, whyNot))
+  {
+    jsonWriter.setNodeIDs(&nodeIDs);
+  }
+  else if (keepIDs)
+  {
+    cerr << "Warning: Not keeping server sequence IDs because " << whyNot
+         << endl;
+  }
+  start = RunStats::now();
   jsonWriter.writeGraph(outGraph, outBases, outPaths);
+  sgClient.getStats().addPhase("write", RunStats::now() - start);
+
+  if (!statsPath.empty())
+  {
+    ofstream statsFile(statsPath.c_str());
+    if (!statsFile)
+    {
+      cerr << "Error: Unable to open " << statsPath << " for writing" << endl;
+    }
+    else
+    {
+      sgClient.getStats().writeJSON(statsFile);
+    }
+  }
 
   /*
   cerr << "INPUT " << endl;
@@ -16,7 +16,8 @@
 using namespace std;
 using namespace rapidjson;
 
-SG2VGJSON::SG2VGJSON() : _os(0), _sg(0), _bases(0), _paths(0), _doc(0)
+SG2VGJSON::SG2VGJSON() : _os(0), _sg(0), _bases(0), _paths(0), _nodeIDs(0),
+                         _doc(0)
 {
 }
 
@@ -38,6 +39,46 @@ void SG2VGJSON::init(ostream* os)
   assert(paths().IsArray());
 }
 
+void SG2VGJSON::setNodeIDs(const vector<sg_int_t>* nodeIDs)
+{
+  _nodeIDs = nodeIDs;
+}
+
+bool SG2VGJSON::getServerNodeIDs(const SideGraph* sg,
+                                 const vector<sg_int_t>& originalIDs,
+                                 const SideGraph* outGraph,
+                                 vector<sg_int_t>& outNodeIDs,
+                                 string& whyNot)
+{
+  stringstream ss;
+  if (outGraph->getNumSequences() != sg->getNumSequences())
+  {
+    ss << outGraph->getNumSequences() - sg->getNumSequences()
+       << " more nodes than sequences (some had to be cut)";
+    whyNot = ss.str();
+    return false;
+  }
+  outNodeIDs.resize(outGraph->getNumSequences());
+  for (sg_int_t i = 0; i < outGraph->getNumSequences(); ++i)
+  {
+    if (outGraph->getSequence(i)->getLength() !=
+        sg->getSequence(i)->getLength())
+    {
+      ss << "node " << (i + 1) << " isn't sequence " << i;
+      whyNot = ss.str();
+      return false;
+    }
+    outNodeIDs[i] = originalIDs[i];
+    if (outNodeIDs[i] <= 0)
+    {
+      ss << outNodeIDs[i] << " isn't a valid VG node ID";
+      whyNot = ss.str();
+      return false;
+    }
+  }
+  return true;
+}
+
 void SG2VGJSON::writeGraph(const SideGraph* sg,
                            const vector<string>& bases,
                            const vector<SGNamedPath>& paths)
@@ -176,8 +217,7 @@ void SG2VGJSON::addNode(const SGSequence* seq)
   node.SetObject();
   addString(node, "sequence", _bases->at(seq->getID()));
   addString(node, "name", seq->getName());
-  // node id's are 1-based in VG! 
-  addInt(node, "id", seq->getID() + 1);
+  addInt(node, "id", getNodeID(seq->getID()));
   nodes().PushBack(node, allocator());
 }
 
@@ -185,9 +225,8 @@ void SG2VGJSON::addEdge(const SGJoin* join)
 {
   Value edge;
   edge.SetObject();
-  // node id's are 1-based in VG! 
-  addInt(edge, "from", join->getSide1().getBase().getSeqID() + 1);
-  addInt(edge, "to", join->getSide2().getBase().getSeqID() + 1);
+  addInt(edge, "from", getNodeID(join->getSide1().getBase().getSeqID()));
+  addInt(edge, "to", getNodeID(join->getSide2().getBase().getSeqID()));
   addBool(edge, "from_start", join->getSide1().getForward() == true);
   addBool(edge, "to_end", join->getSide2().getForward() == false);
   edges().PushBack(edge, allocator());
@@ -212,7 +251,7 @@ void SG2VGJSON::addPath(const string& name, const vector<SGSegment>& path,
       stringstream ss;
       ss << "Sanity check fail for Mapping " << i << " of path " << name
          << ": Segment size " << path[i].getLength() << " does not span "
-         << "all of node " << (sgSeqID + 1) << " which has length "
+         << "all of node " << getNodeID(sgSeqID) << " which has length "
          << _sg->getSequence(sgSeqID)->getLength();
       throw runtime_error(ss.str());
     }
@@ -220,8 +259,7 @@ void SG2VGJSON::addPath(const string& name, const vector<SGSegment>& path,
     
     Value position;
     position.SetObject();
-    // node id's are 1-based in VG!
-    addInt(position, "node_id", sgSeqID + 1);
+    addInt(position, "node_id", getNodeID(sgSeqID));
     // Offsets are along the strand of the node that is being visited.
     // We always use the whole node.
     addInt(position, "offset", 0);
@@ -247,10 +285,10 @@ void SG2VGJSON::addPath(const string& name, const vector<SGSegment>& path,
 }
 
 
-void SG2VGJSON::addInt(Value& value, const string& name, int v)
+void SG2VGJSON::addInt(Value& value, const string& name, sg_int_t v)
 {
   Value intValue;
-  intValue.SetInt(v);
+  intValue.SetInt64(v);
   Value nameValue;
   nameValue.SetString(name.c_str(), name.length(), allocator());
   value.AddMember(nameValue, intValue, allocator());
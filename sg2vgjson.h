@@ -47,6 +47,23 @@ public:
    /** init output stream and json document */
    void init(std::ostream* os);
 
+   /** use nodeIDs[i] as the node id of sequence i, rather than i + 1
+    * (NULL to go back to that).  They must all be positive and 
+    * distinct. */
+   void setNodeIDs(const std::vector<sg_int_t>* nodeIDs);
+
+   /** node ids (for setNodeIDs()) that are the server's ids 
+    * (originalIDs) for the sequences of sg, if outGraph (sg made into
+    * a sequence graph) has the same nodes as it.  Only the number of
+    * sequences and their lengths are compared: conversion only ever 
+    * cuts sequences (and may change the case of their bases).  returns
+    * false, and why in whyNot, if not */
+   static bool getServerNodeIDs(const SideGraph* sg,
+                                const std::vector<sg_int_t>& originalIDs,
+                                const SideGraph* outGraph,
+                                std::vector<sg_int_t>& outNodeIDs,
+                                std::string& whyNot);
+
    /** write nodes and edges and paths*/
    void writeGraph(const SideGraph* sg,
                    const std::vector<std::string>& bases,
@@ -62,6 +79,9 @@ public:
    
 protected:
 
+   /** VG node id of sequence */
+   sg_int_t getNodeID(sg_int_t seqID) const;
+
    // add to json doc
    void addNode(const SGSequence* seq);
    void addEdge(const SGJoin* join);
@@ -70,7 +90,8 @@ protected:
 
    // rapidjson interface seems pretty horrible but too late to switch
    // apis.  some helpers:
-   void addInt(rapidjson::Value& value, const std::string& name, int v);
+   void addInt(rapidjson::Value& value, const std::string& name,
+               sg_int_t v);
    void addString(rapidjson::Value& value, const std::string& name,
                   const std::string& v);
    void addBool(rapidjson::Value& value, const std::string& name, bool v);
@@ -85,10 +106,17 @@ protected:
    const SideGraph* _sg;
    const std::vector<std::string>* _bases;
    const std::vector<std::pair<std::string, std::vector<SGSegment> > >* _paths;
+   const std::vector<sg_int_t>* _nodeIDs;
 
    rapidjson::Document* _doc;
 };
 
+inline sg_int_t SG2VGJSON::getNodeID(sg_int_t seqID) const
+{
+  // node id's are 1-based in VG! 
+  return _nodeIDs != NULL ? _nodeIDs->at(seqID) : seqID + 1;
+}
+
 inline rapidjson::Value& SG2VGJSON::nodes()
 {
   return (*_doc)["node"];
@@ -6,6 +6,10 @@
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cmath>
 
 #include "rapidjson/document.h"    
 #include "rapidjson/writer.h"
@@ -19,12 +23,28 @@ using namespace std;
 using namespace rapidjson;
 
 const int SGClient::DefaultPageSize = 1000;
+const int SGClient::DefaultFanout = 1;
+const int SGClient::MinAdaptivePageSize = 10;
+const int SGClient::MaxAdaptivePageSize = 100000;
+const double SGClient::DefaultTargetSeconds = 1.;
+const size_t SGClient::DefaultTargetBytes = 4 << 20;
 const string SGClient::CTHeader = "Content-Type: application/json";
+const size_t SGClient::MinParallelJoins = 64 * 1024;
+const size_t SGClient::MaxJoinErrors = 100;
+const size_t SGClient::MinParallelSegments = 64 * 1024;
 
 SGClient::SGClient() : _sg(0), _os(0), _pageSize(DefaultPageSize),
-                       _skipPaths(false)
+                       _adaptivePageSize(false),
+                       _targetSeconds(DefaultTargetSeconds),
+                       _targetBytes(DefaultTargetBytes),
+                       _skipPaths(false), _fanout(DefaultFanout),
+                       _pipelined(false), _concurrentPhases(false),
+                       _streaming(true), _upperCase(false),
+                       _abortPages(false),
+                       _pageResumes(Download::DefaultMaxRetries),
+                       _resumeCount(0)
 {
-
+  _download.setStats(&_stats);
 }
 
 SGClient::~SGClient()
@@ -62,6 +82,9 @@ void SGClient::setURL(const string& baseURL)
   }
 
   _sg = new SideGraph();
+  _seqIDs.clear();
+  _seqLengths.clear();
+  _joinIndex.clear();
 }
 
 void SGClient::setOS(ostream* os)
@@ -74,11 +97,105 @@ void SGClient::setPageSize(int pageSize)
   _pageSize = pageSize;
 }
 
+void SGClient::setAdaptivePageSize(bool adaptive, double targetSeconds,
+                                   size_t targetBytes)
+{
+  _adaptivePageSize = adaptive;
+  _targetSeconds = targetSeconds;
+  _targetBytes = targetBytes;
+}
+
 void SGClient::setSkipPaths(bool skipPaths)
 {
   _skipPaths = skipPaths;
 }
 
+void SGClient::setConnections(int connections)
+{
+  _download.setMaxInFlight(connections);
+}
+
+void SGClient::setFanout(int fanout)
+{
+  _fanout = fanout;
+}
+
+void SGClient::setPipelined(bool pipelined)
+{
+  _pipelined = pipelined;
+  _download.setBackground(pipelined || _parsePool.getThreads() > 0);
+}
+
+void SGClient::setRetries(int retries)
+{
+  _download.setMaxRetries(retries);
+  _pageResumes = retries;
+}
+
+void SGClient::setStallTimeout(int seconds)
+{
+  _download.setStallTimeout(seconds);
+}
+
+void SGClient::setCacheDir(const string& directory, size_t maxBytes)
+{
+  _download.setCacheDir(directory, maxBytes);
+}
+
+void SGClient::setRecordDir(const string& directory)
+{
+  _download.setTransport(Download::Record, directory);
+}
+
+void SGClient::setReplayDir(const string& directory, double latency,
+                            double bandwidth)
+{
+  _download.setTransport(Download::Replay, directory);
+  _download.setReplaySpeed(latency, bandwidth);
+}
+
+void SGClient::setCompression(bool compression)
+{
+  _download.setCompression(compression);
+}
+
+void SGClient::setConcurrentPhases(bool concurrentPhases)
+{
+  _concurrentPhases = concurrentPhases;
+}
+
+void SGClient::setStreaming(bool streaming)
+{
+  _streaming = streaming;
+}
+
+void SGClient::setParseThreads(int threads)
+{
+  _parsePool.start(threads);
+  _poolParsers.clear();
+  for (int i = 0; i < threads; ++i)
+  {
+    _poolParsers.emplace_back();
+    _poolParsers.back().setUpperCase(_upperCase);
+  }
+  // the thread adding the pages can't drive the transfers while it's 
+  // waiting for the pool
+  _download.setBackground(_pipelined || threads > 0);
+}
+
+void SGClient::setUpperCase(bool upperCase)
+{
+  _upperCase = upperCase;
+  for (int i = 0; i <= AllelePage; ++i)
+  {
+    _parsers[i].setUpperCase(upperCase);
+  }
+  for (size_t i = 0; i < _poolParsers.size(); ++i)
+  {
+    _poolParsers[i].setUpperCase(upperCase);
+  }
+}
+
 ostream& SGClient::os()
 {
   return _os != NULL ? *_os : _ignore;
@@ -87,12 +204,25 @@ ostream& SGClient::os()
 const SideGraph* SGClient::downloadGraph(vector<string>& outBases,
                                          vector<SGNamedPath>& outPaths)
 {
-  map<int, string> refIDMap;
-  os() << "Downloading References...";
-  for (int pageToken = 0; pageToken >= 0;)
+  // in concurrent mode, everything is downloaded up front and just gets
+  // added to the graph below, in the same order as the sequential mode
+  GraphPages pages;
+  const char* verb = "Downloading";
+  if (_concurrentPhases == true)
   {
-    pageToken = downloadReferences(refIDMap, pageToken, _pageSize);
+    os() << "Downloading References, Sequences, Joins"
+         << (_skipPaths ? "" : " and allele paths") << " concurrently..."
+         << endl;
+    downloadPagesConcurrently(pages);
+    verb = "Adding";
   }
+  
+  os() << verb << " References...";
+  if (_concurrentPhases == false)
+  {
+    downloadPages(ReferencePage, pages);
+  }
+  const map<int, string>& refIDMap = pages.refIDMap;
   os() << " (" << refIDMap.size() << " references retrieved)" << endl;
   if (refIDMap.size() == 0)
   {
@@ -101,38 +231,411 @@ const SideGraph* SGClient::downloadGraph(vector<string>& outBases,
   
   vector<const SGSequence*> seqs;
   outBases.clear();
-  os() << "Downloading Sequences...";
-  for (int pageToken = 0; pageToken >= 0;)
+  os() << verb << " Sequences...";
+  if (_concurrentPhases == false)
   {
-    pageToken = downloadSequences(seqs, &outBases,
-                                  refIDMap.empty() ? NULL : &refIDMap,
-                                  pageToken, _pageSize);
+    downloadPages(SequencePage, pages);
   }
+  double addStart = RunStats::now();
+  addSequences(pages.sequences, seqs, &outBases,
+               refIDMap.empty() ? NULL : &refIDMap);
+  _stats.addPhase(getSearchName(SequencePage), RunStats::now() - addStart);
   os() << " (" << seqs.size() << " sequences retrieved)" << endl;
   
   vector<const SGJoin*> joins;
-  os() << "Downloading Joins...";
-  for (int pageToken = 0; pageToken >= 0;)
+  os() << verb << " Joins...";
+  if (_concurrentPhases == false)
   {
-    pageToken = downloadJoins(joins, pageToken, _pageSize);
+    downloadPages(JoinPage, pages);
   }
+  addStart = RunStats::now();
+  addJoins(pages.joins, joins);
+  _stats.addPhase(getSearchName(JoinPage), RunStats::now() - addStart);
   os() << " (" << joins.size() << " joins retrieved)" << endl;
 
 
   outPaths.clear();
   if (_skipPaths == false)
   {
-    os() << "Downloading allele paths... ";
-    for (int pageToken = 0; pageToken >= 0;)
+    os() << verb << " allele paths... ";
+    if (_concurrentPhases == false)
     {
-      pageToken = downloadAllelePaths(outPaths, pageToken, _pageSize);
+      downloadPages(AllelePage, pages);
     }
+    addStart = RunStats::now();
+    addAllelePaths(pages.alleles, outPaths);
+    _stats.addPhase(getSearchName(AllelePage), RunStats::now() - addStart);
     os() << "(" << outPaths.size() << " paths retrieved)" << endl;
   }
+
+  os() << "(" << _download.getRequestCount() << " requests made over "
+       << _download.getConnectionCount() << " connections, "
+       << _download.getBytesReceived() << " bytes received, "
+       << _download.getBytesDecoded() << " bytes decompressed)" << endl;
+  os() << "(" << _download.getRetryCount() << " requests retried, "
+       << _resumeCount << " searches resumed)" << endl;
+  const ResponseCache& cache = _download.getCache();
+  if (cache.isOpen())
+  {
+    os() << "(cache: " << cache.getHits() << " hits, " << cache.getMisses()
+         << " misses, " << cache.getStores() << " stores, "
+         << cache.getEvictions() << " evictions, " << cache.getBytes()
+         << " bytes on disk)" << endl;
+  }
   
   return getSideGraph();
 }
 
+void SGClient::downloadPages(PageType type, GraphPages& pages)
+{
+  double phaseStart = RunStats::now();
+  PageQueue queue;
+  int pageToken = 0;
+  int resumes = 0;
+  for (startPages(queue, type, 0); !queue.finished;)
+  {
+    int nextPageToken = -2;
+    try
+    {
+      Download::Request* request = nextPage(queue, pageToken);
+      vector<int> alleleIDs;
+      if (_parsePool.getThreads() > 0)
+      {
+        nextPageToken = parsePooledPage(queue, pages, alleleIDs);
+      }
+      else
+      {
+        nextPageToken = parsePage(type, request, pageToken, pages, alleleIDs);
+      }
+      // (pages is shared by concurrent phases, so only the allele
+      // search may touch pages.alleles)
+      if (type == AllelePage)
+      {
+        downloadAlleles(alleleIDs, pages.alleles);
+      }
+    }
+    catch (TransferError& e)
+    {
+      // Download already retried the request (if it was worth it), but
+      // everything up to this page is safe in pages, so rather than give
+      // up on all that we wait a bit and start over from this page.
+      // (anything wrong with what was downloaded won't go away, so
+      // isn't caught here)
+      clearPages(queue);
+      if (_abortPages || resumes >= _pageResumes)
+      {
+        throw;
+      }
+      ++resumes;
+      ++_resumeCount;
+      os() << "\nWarning: " << e.what() << ".  Resuming "
+           << getSearchPath(type) << " from pageToken=" << pageToken
+           << " (attempt " << resumes << " of " << _pageResumes << ") ";
+      this_thread::sleep_for(chrono::duration<double>(
+        min(_download.getRetryDelay() * pow(2., resumes), 30.)));
+      // (keeping the page size we've learned)
+      queue.nextToken = pageToken;
+      continue;
+    }
+    catch (...)
+    {
+      clearPages(queue);
+      throw;
+    }
+    resumes = 0;
+    endPage(queue, nextPageToken);
+  }
+  _stats.addPhase(getSearchName(type), RunStats::now() - phaseStart);
+  _stats.setPageSize(getSearchName(type), queue.pageSize);
+}
+
+int SGClient::parsePage(PageType type, Download::Request* request,
+                        int pageToken, GraphPages& pages,
+                        vector<int>& outAlleleIDs)
+{
+  JSON2SG& parser = _parsers[type];
+  if (_streaming)
+  {
+    ResponseStream response(_download, request);
+    try
+    {
+      return parsePage(parser, type, response, pageToken, pages,
+                       outAlleleIDs);
+    }
+    catch (runtime_error& e)
+    {
+      if (!response.isInterrupted())
+      {
+        throw;
+      }
+      // the attempt we were reading failed, so start again on whatever
+      // the retry gets (the page parsers leave pages alone on error)
+    }
+  }
+  _download.wait(request);
+  ResponseStream response(request->buffer.memory, request->buffer.size);
+  return parsePage(parser, type, response, pageToken, pages, outAlleleIDs);
+}
+
+int SGClient::parsePage(JSON2SG& parser, PageType type,
+                        ResponseStream& response, int pageToken,
+                        GraphPages& pages, vector<int>& outAlleleIDs)
+{
+  int nextPageToken = -2;
+  switch (type)
+  {
+  case ReferencePage:
+    nextPageToken = parseReferencePage(parser, response, pageToken,
+                                       pages.refIDMap);
+    break;
+  case SequencePage:
+    nextPageToken = parseSequencePage(parser, response, pageToken,
+                                      pages.sequences);
+    break;
+  case JoinPage:
+    nextPageToken = parseJoinPage(parser, response, pageToken, pages.joins);
+    break;
+  case AllelePage:
+    nextPageToken = parseAllelePage(parser, response, pageToken,
+                                    outAlleleIDs);
+    break;
+  }
+  return nextPageToken;
+}
+
+int SGClient::parsePooledPage(PageQueue& queue, GraphPages& pages,
+                              vector<int>& outAlleleIDs)
+{
+  // once the front page is here, every page that's arrived so far can
+  // be parsed at the same time
+  _download.wait(queue.pages.front().request);
+  for (size_t i = 0; i < queue.pages.size(); ++i)
+  {
+    PageQueue::Page& page = queue.pages[i];
+    if (!page.parsing.valid() && _download.isDone(page.request))
+    {
+      submitPage(queue.type, page);
+    }
+  }
+
+  // (throws whatever the parse did)
+  queue.pages.front().parsing.get();
+  ParsedPage& parsed = *queue.pages.front().parsed;
+  // (only touch this search's part of pages: with concurrent phases, the
+  // other searches are filling in theirs at the same time)
+  switch (queue.type)
+  {
+  case ReferencePage:
+    pages.refIDMap.insert(parsed.pages.refIDMap.begin(),
+                          parsed.pages.refIDMap.end());
+    break;
+  case SequencePage:
+    pages.sequences.append(parsed.pages.sequences);
+    break;
+  case JoinPage:
+    pages.joins.append(parsed.pages.joins);
+    break;
+  case AllelePage:
+    outAlleleIDs.swap(parsed.alleleIDs);
+    break;
+  }
+  return parsed.nextPageToken;
+}
+
+void SGClient::submitPage(PageType type, PageQueue::Page& page)
+{
+  shared_ptr<ParsedPage> parsed(new ParsedPage());
+  Download::Request* request = page.request;
+  int pageToken = page.token;
+  page.parsed = parsed;
+  page.parsing = _parsePool.submit([this, type, request, pageToken, parsed](
+                                     int worker)
+  {
+    // (the request is done, so this just throws if it failed)
+    _download.wait(request);
+    ResponseStream response(request->buffer.memory, request->buffer.size);
+    parsed->nextPageToken = parsePage(_poolParsers[worker], type, response,
+                                      pageToken, parsed->pages,
+                                      parsed->alleleIDs);
+  });
+}
+
+void SGClient::downloadPagesConcurrently(GraphPages& pages)
+{
+  // each search gets its own thread, sharing the same Download object.
+  // it can only be shared in background mode, where a single I/O thread
+  // drives all the transfers.
+  bool background = _download.getBackground();
+  _download.setBackground(true);
+  _abortPages = false;
+
+  vector<PageType> types;
+  types.push_back(ReferencePage);
+  types.push_back(SequencePage);
+  types.push_back(JoinPage);
+  if (_skipPaths == false)
+  {
+    types.push_back(AllelePage);
+  }
+  vector<exception_ptr> errors(types.size());
+  vector<thread> threads;
+  for (int i = 0; i < types.size(); ++i)
+  {
+    threads.push_back(thread(&SGClient::downloadPagesInThread, this,
+                             types[i], &pages, &errors[i]));
+  }
+  for (int i = 0; i < threads.size(); ++i)
+  {
+    threads[i].join();
+  }
+  _download.setBackground(background);
+
+  // report the first error (the others will just be cancellations)
+  for (int i = 0; i < errors.size(); ++i)
+  {
+    if (errors[i])
+    {
+      rethrow_exception(errors[i]);
+    }
+  }
+}
+
+void SGClient::downloadPagesInThread(PageType type, GraphPages* pages,
+                                     exception_ptr* error)
+{
+  try
+  {
+    downloadPages(type, *pages);
+  }
+  catch (...)
+  {
+    if (_abortPages.exchange(true) == false)
+    {
+      *error = current_exception();
+    }
+  }
+}
+
+void SGClient::startPages(PageQueue& queue, PageType type, int pageToken)
+{
+  queue.type = type;
+  queue.pages.clear();
+  queue.nextToken = pageToken;
+  queue.pageSize = _pageSize;
+  queue.serverCap = -1;
+  queue.finished = false;
+}
+
+Download::Request* SGClient::nextPage(PageQueue& queue, int& outPageToken)
+{
+  assert(!queue.finished);
+  if (_abortPages)
+  {
+    clearPages(queue);
+    throw runtime_error("Download cancelled");
+  }
+  // when pipelining, always keep (at least) one page in flight behind the
+  // one we're about to process
+  int depth = max(_fanout, _pipelined ? 2 : 1);
+  while (queue.pages.size() < depth)
+  {
+    PageQueue::Page page;
+    page.token = queue.nextToken;
+    page.stride = queue.serverCap > 0 ?
+       min(queue.pageSize, queue.serverCap) : queue.pageSize;
+    page.request = _download.submitPost(
+      _url + getSearchPath(queue.type), vector<string>(1, CTHeader),
+      getPostOptions(queue.type, page.token, queue.pageSize));
+    queue.pages.push_back(page);
+    queue.nextToken += page.stride;
+  }
+  outPageToken = queue.pages.front().token;
+  return queue.pages.front().request;
+}
+
+void SGClient::endPage(PageQueue& queue, int nextPageToken)
+{
+  assert(!queue.pages.empty());
+  PageQueue::Page page = queue.pages.front();
+  queue.pages.pop_front();
+  if (_adaptivePageSize && nextPageToken > page.token)
+  {
+    // (the last page doesn't tell us anything, it's just short).
+    // cached and replayed responses don't take real time, so whenever a
+    // cache or archive is in use pages are sized by bytes alone.  the
+    // same requests are then made on every run, and found again.
+    bool timed = _download.getTransport() == Download::Live &&
+       !_download.getCache().isOpen();
+    adaptPageSize(queue, nextPageToken - page.token,
+                  timed ? page.request->seconds : 0.,
+                  page.request->buffer.size);
+  }
+  _download.release(page.request);
+  
+  if (nextPageToken < 0)
+  {
+    // last page: forget about any speculative requests past the end
+    clearPages(queue);
+    queue.finished = true;
+  }
+  else if (nextPageToken != page.token + page.stride)
+  {
+    // server returned a different number of records than we guessed, 
+    // (probably because it caps the page size), so start again from
+    // where it says to go using its page size.
+    clearPages(queue);
+    if (nextPageToken > page.token)
+    {
+      queue.serverCap = nextPageToken - page.token;
+    }
+    queue.nextToken = nextPageToken;
+  }
+}
+
+void SGClient::clearPages(PageQueue& queue)
+{
+  for (int i = 0; i < queue.pages.size(); ++i)
+  {
+    if (queue.pages[i].parsing.valid())
+    {
+      // can't free the response under the parser
+      queue.pages[i].parsing.wait();
+    }
+    _download.release(queue.pages[i].request);
+  }
+  queue.pages.clear();
+}
+
+void SGClient::adaptPageSize(PageQueue& queue, int records, double seconds,
+                             size_t bytes)
+{
+  // assume time and size are proportional to the number of records, and
+  // scale the page to whichever target it would hit first.  time isn't
+  // really proportional (every request has some fixed latency), so we
+  // never more than double or halve at once and work up to the right
+  // size over a few pages.  pages already requested keep their size,
+  // the token of the next page is still just the sum of the sizes
+  // before it.
+  double scale = 2.;
+  if (seconds > 0.)
+  {
+    scale = min(scale, _targetSeconds / seconds);
+  }
+  if (bytes > 0)
+  {
+    scale = min(scale, (double)_targetBytes / bytes);
+  }
+  scale = max(scale, 0.5);
+  int pageSize = (int)(records * scale);
+  if (queue.serverCap > 0 && pageSize > queue.serverCap)
+  {
+    // no point asking for more than we'll get
+    pageSize = queue.serverCap;
+  }
+  queue.pageSize = max(MinAdaptivePageSize,
+                       min(MaxAdaptivePageSize, pageSize));
+}
+
 int SGClient::downloadSequences(vector<const SGSequence*>& outSequences,
                                 vector<string>* outBases,
                                 const map<int, string>* nameIdMap,
@@ -150,48 +653,77 @@ int SGClient::downloadSequences(vector<const SGSequence*>& outSequences,
                                              vector<string>(1, CTHeader),
                                              postOptions);
 
-  // Parse the JSON output into a Sequences array and add it to the side graph
-  JSON2SG parser;
-  vector<SGSequence*> sequences;
-  vector<string> bases;
+  SequenceBatch sequences;
+  ResponseStream response(result);
+  int nextPageToken = parseSequencePage(_parsers[SequencePage], response,
+                                        pageToken, sequences);
+  addSequences(sequences, outSequences, outBases, nameIdMap);
+  return nextPageToken;
+}
+
+int SGClient::parseSequencePage(JSON2SG& parser, ResponseStream& response,
+                                int pageToken, SequenceBatch& outSequences)
+{
+  // Parse the JSON output straight onto the end of outSequences
+  size_t start = outSequences.size();
   int nextPageToken = -2;
-  int ret = parser.parseSequences(result, sequences, bases, nextPageToken);
+  double parseStart = RunStats::now();
+  int ret = parser.parseSequences(response, outSequences, nextPageToken);
+  // (not counting time waiting for the page to arrive)
+  double parseSeconds = RunStats::now() - parseStart -
+     response.getWaitSeconds();
+  size_t count = outSequences.size() - start;
+  _stats.addParse(getSearchName(SequencePage), parseSeconds, count);
   if (ret == -1 || nextPageToken <= -2)
   {
+    outSequences.resize(start);
     stringstream ss;
-    ss << "Error: POST request for Sequences returned " << result;
+    ss << "Error: POST request for Sequences returned " << response.getText();
     throw runtime_error(ss.str());
   }
-  if (nextPageToken >= 0 && pageToken + sequences.size() != nextPageToken)
+  if (nextPageToken >= 0 && pageToken + count != nextPageToken)
   {
+    outSequences.resize(start);
     stringstream ss;
     ss << "Error: nextPageToken=" << nextPageToken << " returned does not "
-       << "equal number of sequences returned (" << sequences.size()
+       << "equal number of sequences returned (" << count
        << ") + pageToken=" << pageToken;
     throw runtime_error(ss.str());
   }
+
+  return nextPageToken;
+}
+
+void SGClient::addSequences(SequenceBatch& sequences,
+                            vector<const SGSequence*>& outSequences,
+                            vector<string>* outBases,
+                            const map<int, string>* nameIdMap)
+{
+  outSequences.reserve(outSequences.size() + sequences.size());
+  if (outBases != NULL)
+  {
+    outBases->reserve(outBases->size() + sequences.size());
+  }
   
-  assert(!outBases || bases.size() == sequences.size());
-  
-  for (int i = 0; i < sequences.size(); ++i)
+  for (size_t i = 0; i < sequences.size(); ++i)
   {
-    sg_int_t originalID = sequences[i]->getID();
+    sg_int_t originalID = sequences.ids[i];
 
+    string name;
     bool foundName = false;
     if (nameIdMap != NULL)
     {
-      map<int, string>::const_iterator si = nameIdMap->find(
-        sequences[i]->getID());
+      map<int, string>::const_iterator si = nameIdMap->find(originalID);
       if (si != nameIdMap->end())
       {
         // name mapped from reference name
-        sequences[i]->setName(si->second);
+        name = si->second;
         foundName = true;
       }
       else
       {
         os() << "\nWarning: Could not find Reference for sequence id "
-             << sequences[i]->getID() << " ";
+             << originalID << " ";
       }
     }
 
@@ -201,23 +733,29 @@ int SGClient::downloadSequences(vector<const SGSequence*>& outSequences,
     {
       stringstream ss;
       ss << "Seq" << originalID;
-      sequences[i]->setName(ss.str());
+      name = ss.str();
     }
     
     // store map to original id as Side Graph interface requires
     // ids be [0,n) which may be unessarily strict.  Too lazy right
     // now to track down SGExport code that depends on this..
-    const SGSequence* addedSeq = _sg->addSequence(sequences[i]);
+    const SGSequence* addedSeq = _sg->addSequence(
+      new SGSequence(originalID, sequences.lengths[i], name));
     addSeqIDMapping(originalID, addedSeq->getID());
+    if (addedSeq->getID() >= (sg_int_t)_seqLengths.size())
+    {
+      _seqLengths.resize(addedSeq->getID() + 1, 0);
+    }
+    _seqLengths[addedSeq->getID()] = addedSeq->getLength();
 
     outSequences.push_back(addedSeq);
     if (outBases != NULL)
     {
-      outBases->push_back(bases[i]);
+      outBases->push_back(string());
+      outBases->back().swap(sequences.bases[i]);
     }
   }
-
-  return nextPageToken;
+  sequences.clear();
 }
 
 int SGClient::downloadReferences(map<int, string>& outIdMap,
@@ -239,15 +777,28 @@ int SGClient::downloadReferences(map<int, string>& outIdMap,
                                              vector<string>(1, CTHeader),
                                              postOptions);
 
+  ResponseStream response(result);
+  return parseReferencePage(_parsers[ReferencePage], response, pageToken,
+                            outIdMap);
+}
+
+int SGClient::parseReferencePage(JSON2SG& parser, ResponseStream& response,
+                                 int pageToken,
+                                 map<int, string>& outIdMap)
+{
   // Parse the JSON output into a Sequences array and add it to the side graph
-  JSON2SG parser;
   map<int, string> idMap;
   int nextPageToken = -2;
-  int ret = parser.parseReferences(result, idMap, nextPageToken);
+  double parseStart = RunStats::now();
+  int ret = parser.parseReferences(response, idMap, nextPageToken);
+  // (not counting time waiting for the page to arrive)
+  double parseSeconds = RunStats::now() - parseStart -
+     response.getWaitSeconds();
+  _stats.addParse(getSearchName(ReferencePage), parseSeconds, idMap.size());
   if (ret == -1 || nextPageToken <= -2)
   {
     stringstream ss;
-    ss << "Error: POST request for References returned " << result;
+    ss << "Error: POST request for References returned " << response.getText();
     throw runtime_error(ss.str());
   }
   if (nextPageToken >= 0 && pageToken + idMap.size() != nextPageToken)
@@ -303,6 +854,7 @@ int SGClient::downloadBases(sg_int_t sgSeqID, string& outBases, int start,
 
   // Parse the JSON output into a string
   JSON2SG parser;
+  parser.setUpperCase(_upperCase);
   int ret = parser.parseBases(result, outBases);
   if (ret == -1)
   {
@@ -336,34 +888,59 @@ int SGClient::downloadJoins(vector<const SGJoin*>& outJoins,
                                              vector<string>(1, CTHeader),
                                              postOptions);
 
-  // Parse the JSON output into a Joins array and add it to the side graph
-  JSON2SG parser;
-  vector<SGJoin*> joins;
+  JoinBatch joins;
+  ResponseStream response(result);
+  int nextPageToken = parseJoinPage(_parsers[JoinPage], response, pageToken,
+                                    joins);
+  addJoins(joins, outJoins);
+  return nextPageToken;
+}
+
+int SGClient::parseJoinPage(JSON2SG& parser, ResponseStream& response,
+                            int pageToken, JoinBatch& outJoins)
+{
+  // Parse the JSON output straight onto the end of outJoins
+  size_t start = outJoins.size();
   int nextPageToken = -2;
-  int ret = parser.parseJoins(result, joins, nextPageToken);
+  double parseStart = RunStats::now();
+  int ret = parser.parseJoins(response, outJoins, nextPageToken);
+  // (not counting time waiting for the page to arrive)
+  double parseSeconds = RunStats::now() - parseStart -
+     response.getWaitSeconds();
+  size_t count = outJoins.size() - start;
+  _stats.addParse(getSearchName(JoinPage), parseSeconds, count);
   if (ret == -1 || nextPageToken <= -2)
   {
+    outJoins.resize(start);
     stringstream ss;
-    ss << "Error: POST request for Joins returned " << result;
+    ss << "Error: POST request for Joins returned " << response.getText();
     throw runtime_error(ss.str());
   }
-  if (nextPageToken >= 0 && pageToken + joins.size() != nextPageToken)
+  if (nextPageToken >= 0 && pageToken + count != nextPageToken)
   {
+    outJoins.resize(start);
     stringstream ss;
     ss << "Error: nextPageToken=" << nextPageToken << " returned does not "
-       << "equal number of joins returned (" << joins.size()
+       << "equal number of joins returned (" << count
        << ") + pageToken=" << pageToken;
     throw runtime_error(ss.str());
   }
   
-  for (int i = 0; i < joins.size(); ++i)
+  return nextPageToken;
+}
+
+void SGClient::addJoins(JoinBatch& joins, vector<const SGJoin*>& outJoins)
+{
+  verifyAndMapJoins(joins);
+  outJoins.reserve(outJoins.size() + joins.size());
+  _joinIndex.reserve(_joinIndex.size() + joins.size());
+  for (size_t i = 0; i < joins.size(); ++i)
   {
-    verifyInJoin(*joins[i]);
-    mapSeqIDsInJoin(*joins[i]);
-    outJoins.push_back(_sg->addJoin(joins[i]));
+    SGJoin join = joins.getJoin(i);
+    _joinIndex.insert(join.getSide1(), join.getSide2());
+    outJoins.push_back(_sg->addJoin(new SGJoin(join)));
   }
-
-  return nextPageToken;
+  joins.clear();
 }
 
 int SGClient::downloadAllelePaths(vector<SGNamedPath>& outPaths,
@@ -381,16 +958,32 @@ int SGClient::downloadAllelePaths(vector<SGNamedPath>& outPaths,
                                              vector<string>(1, CTHeader),
                                              postOptions);
 
+  vector<int> alleleIDs;
+  vector<AlleleRecord> alleles;
+  ResponseStream response(result);
+  int nextPageToken = parseAllelePage(_parsers[AllelePage], response,
+                                      pageToken, alleleIDs);
+  downloadAlleles(alleleIDs, alleles);
+  addAllelePaths(alleles, outPaths);
+  return nextPageToken;
+}
+
+int SGClient::parseAllelePage(JSON2SG& parser, ResponseStream& response,
+                              int pageToken, vector<int>& outAlleleIDs)
+{
   // POST Request doesn't return paths for some reason.  So we scrape out
   // all the allele ID's from the result:
-  JSON2SG parser;
   vector<int> alleleIDs;
   int nextPageToken = -2;
-  int ret = parser.parseAlleleIDs(result, alleleIDs, nextPageToken);
+  double parseStart = RunStats::now();
+  int ret = parser.parseAlleleIDs(response, alleleIDs, nextPageToken);
+  double parseSeconds = RunStats::now() - parseStart -
+     response.getWaitSeconds();
+  _stats.addParse(getSearchName(AllelePage), parseSeconds, alleleIDs.size());
   if (ret == -1 || nextPageToken <= -2)
   {
     stringstream ss;
-    ss << "Error: POST request for Alleles returned " << result;
+    ss << "Error: POST request for Alleles returned " << response.getText();
     throw runtime_error(ss.str());
   }
   if (nextPageToken >= 0 && pageToken + alleleIDs.size() != nextPageToken)
@@ -402,82 +995,263 @@ int SGClient::downloadAllelePaths(vector<SGNamedPath>& outPaths,
     throw runtime_error(ss.str());
   }
 
-  // With IDs in hand, we call downloadAllele on each one to get the path.
-  SGNamedPath allelePath;
-  int alleleVariantSetID;
-  for (int i = 0; i < alleleIDs.size(); ++i)
+  outAlleleIDs.swap(alleleIDs);
+  return nextPageToken;
+}
+
+void SGClient::downloadAlleles(const vector<int>& alleleIDs,
+                               vector<AlleleRecord>& outAlleles)
+{
+  // With IDs in hand, we GET each allele to get the path.  These requests
+  // are independent so we keep a window of them running in parallel, but
+  // results are processed in order so outAlleles doesn't change.  With
+  // the parse pool, each response is handed to the pool as soon as it's
+  // here, and its request is kept until the parse is done
+  vector<Download::Request*> requests(alleleIDs.size(), NULL);
+  vector<shared_future<void> > parses(alleleIDs.size());
+  vector<double> parseSeconds(alleleIDs.size(), 0.);
+  size_t window = 2 * _download.getMaxInFlight();
+  size_t submitted = 0;
+  size_t released = 0;
+  size_t allelesOffset = outAlleles.size();
+  outAlleles.resize(allelesOffset + alleleIDs.size());
+  try
   {
-    allelePath.first.clear();
-    allelePath.second.clear();
-    ret = downloadAllele(alleleIDs[i], allelePath.second, alleleVariantSetID,
-                         allelePath.first);
-    if (ret >= 0)
+    for (int i = 0; i < alleleIDs.size(); ++i)
     {
-      outPaths.push_back(allelePath);
+      // (another search failed, see downloadPagesInThread())
+      if (_abortPages)
+      {
+        throw runtime_error("Download cancelled");
+      }
+      // (the window can be full of requests still being parsed, but
+      // the one we're about to wait for always has to be submitted)
+      for (; submitted < alleleIDs.size() &&
+             (submitted <= i || submitted < released + window);
+           ++submitted)
+      {
+        requests[submitted] = _download.submitGet(
+          getAlleleURL(alleleIDs[submitted]), vector<string>());
+      }
+      const char* result = _download.wait(requests[i]);
+      if (_parsePool.getThreads() > 0)
+      {
+        int alleleID = alleleIDs[i];
+        AlleleRecord* allele = &outAlleles[allelesOffset + i];
+        double* seconds = &parseSeconds[i];
+        parses[i] = _parsePool.submit(
+          [this, alleleID, result, allele, seconds](int worker)
+          {
+            double parseStart = RunStats::now();
+            parseAllele(_poolParsers[worker], alleleID, result, *allele);
+            *seconds = RunStats::now() - parseStart;
+          });
+      }
+      else
+      {
+        double parseStart = RunStats::now();
+        parseAllele(_parsers[AllelePage], alleleIDs[i], result,
+                    outAlleles[allelesOffset + i]);
+        parseSeconds[i] = RunStats::now() - parseStart;
+      }
+      // free the requests whose parses are done
+      for (; released <= i && (!parses[released].valid() ||
+                               parses[released].wait_for(
+                                 chrono::seconds(0)) ==
+                               future_status::ready); ++released)
+      {
+        if (parses[released].valid())
+        {
+          parses[released].get();
+        }
+        _download.release(requests[released]);
+        requests[released] = NULL;
+      }
+    }
+    for (; released < alleleIDs.size(); ++released)
+    {
+      parses[released].get();
+      _download.release(requests[released]);
+      requests[released] = NULL;
     }
-    // Note: if ret < 0, then downloadAllele spits warning
   }
+  catch (...)
+  {
+    for (int i = 0; i < submitted; ++i)
+    {
+      if (parses[i].valid())
+      {
+        parses[i].wait();
+      }
+      if (requests[i] != NULL)
+      {
+        _download.release(requests[i]);
+      }
+    }
+    // leave outAlleles as it was, so the page can be tried again
+    outAlleles.resize(allelesOffset);
+    throw;
+  }
+  // (not counting time waiting for the GETs)
+  double totalSeconds = 0.;
+  for (size_t i = 0; i < parseSeconds.size(); ++i)
+  {
+    totalSeconds += parseSeconds[i];
+  }
+  _stats.addParseSeconds(getSearchName(AllelePage), totalSeconds);
+}
 
-  return nextPageToken;
+void SGClient::addAllelePaths(vector<AlleleRecord>& alleles,
+                              vector<SGNamedPath>& outPaths)
+{
+  size_t segments = 0;
+  for (size_t i = 0; i < alleles.size(); ++i)
+  {
+    segments += alleles[i].path.second.size();
+  }
+  int threads = _parsePool.getThreads();
+  if (threads > 0 && segments >= MinParallelSegments)
+  {
+    // check the paths (which only reads the id map and join index) all
+    // at once, then add them in order below
+    vector<future<void> > checks;
+    for (int t = 0; t < threads; ++t)
+    {
+      checks.push_back(_parsePool.submit([&, t, threads](int) {
+            for (size_t i = t; i < alleles.size(); i += threads)
+            {
+              checkAllelePath(alleles[i]);
+            }
+          }));
+    }
+    for (size_t i = 0; i < checks.size(); ++i)
+    {
+      checks[i].wait();
+    }
+    for (size_t i = 0; i < checks.size(); ++i)
+    {
+      checks[i].get();
+    }
+  }
+  else
+  {
+    for (size_t i = 0; i < alleles.size(); ++i)
+    {
+      checkAllelePath(alleles[i]);
+    }
+  }
+
+  for (int i = 0; i < alleles.size(); ++i)
+  {
+    if (addAllelePath(alleles[i]) == true)
+    {
+      outPaths.push_back(SGNamedPath());
+      outPaths.back().first.swap(alleles[i].path.first);
+      outPaths.back().second.swap(alleles[i].path.second);
+    }
+    // Note: if addAllelePath fails, then it spits warning
+  }
+  alleles.clear();
 }
 
 int SGClient::downloadAllele(int alleleID, vector<SGSegment>& outPath,
                              int& outVariantSetID, string& outName)
 {
-  outPath.clear();
+  const char* result = _download.getRequest(getAlleleURL(alleleID),
+                                            vector<string>());
 
-  stringstream opts;
-  opts << "/alleles/" << alleleID;
-  string path = opts.str();
+  AlleleRecord allele;
+  parseAllele(_parsers[AllelePage], alleleID, result, allele);
+  checkAllelePath(allele);
+  addAllelePath(allele);
+  outPath.swap(allele.path.second);
+  outVariantSetID = allele.variantSetID;
+  outName.swap(allele.path.first);
+  return allele.ret;
+}
 
-  const char* result = _download.getRequest(_url + path,
-                                            vector<string>());
+void SGClient::parseAllele(JSON2SG& parser, int alleleID,
+                           const char* result, AlleleRecord& outAllele)
+{
+  outAllele.id = alleleID;
+  outAllele.path.first.clear();
+  outAllele.path.second.clear();
+  outAllele.variantSetID = -1;
+  outAllele.response.clear();
+  outAllele.error.clear();
 
   int outID;
-  JSON2SG parser;
-  int ret = parser.parseAllele(result, outID, outPath, outVariantSetID,
-                               outName);
+  outAllele.ret = parser.parseAllele(result, outID, outAllele.path.second,
+                                     outAllele.variantSetID,
+                                     outAllele.path.first);
 
-  if (ret >=0 && outID != alleleID)
+  if (outAllele.ret >=0 && outID != alleleID)
   {
     throw runtime_error("AlleleID mismatch");
   }
-  if (ret < 0)
+  if (outAllele.ret < 0)
+  {
+    // keep for error message
+    outAllele.response = result;
+  }
+}
+
+bool SGClient::addAllelePath(AlleleRecord& allele)
+{
+  if (allele.ret < 0)
+  {
+    os() << "Warning: Unable to download allele with ID " << allele.id
+         << ". Server returned: " << allele.response << endl;
+  }
+
+  if (!allele.error.empty())
   {
-    os() << "Warning: Unable to download allele with ID " << alleleID
-         << ". Server returned: " << result << endl;
+    os() << "Warning: Skipping allele path " << allele.path.first
+         << " because validation produced the following error: "
+         << allele.error << endl;
+    allele.ret = -1;
   }
 
+  return allele.ret >= 0;
+}
+
+void SGClient::checkAllelePath(AlleleRecord& allele) const
+{
   try
   {
-    verifyInPath(alleleID, outPath);
-    mapSeqIDsInPath(outPath);
+    verifyInPath(allele.id, allele.path.second);
+    if (!_seqIDs.isIdentity())
+    {
+      mapSeqIDsInPath(allele.path.second);
+    }
   }
   catch (exception& e)
   {
-    os() << "Warning: Skipping allele path " << outName
-         << " because validation produced the following error: " << e.what()
-         << endl;
-    ret = -1;
+    allele.error = e.what();
   }
+}
 
-  return ret;
+string SGClient::getAlleleURL(int alleleID) const
+{
+  stringstream opts;
+  opts << _url << "/alleles/" << alleleID;
+  return opts.str();
 }
 
-void SGClient::verifyInJoin(const SGJoin& join) const
+string SGClient::getJoinError(const SGJoin& join) const
 {
   const SGPosition& pos1 = join.getSide1().getBase();
   const SGPosition& pos2 = join.getSide2().getBase();
   sg_int_t sgid1 = getSGSeqID(pos1.getSeqID());
   sg_int_t sgid2 = getSGSeqID(pos2.getSeqID());
 
+  stringstream ss;
   if (sgid1 < 0 || sgid2 < 0)
   {
-    stringstream ss;
     ss << "Invalid input join: " << join << ". Sequence ID "
        << (sgid1 < 0 ? pos1.getSeqID() : pos2.getSeqID()) 
        << " not found in input graph";
-    throw runtime_error(ss.str());
+    return ss.str();
   }
 
   const SGSequence* seq1 = _sg->getSequence(sgid1);
@@ -485,27 +1259,118 @@ void SGClient::verifyInJoin(const SGJoin& join) const
 
   if (pos1.getPos() < 0 || pos1.getPos() >= seq1->getLength())
   {
-    stringstream ss;
     ss << "Invalid input join: " << join << ". Position of Side 1"
        << " (" << pos1.getPos() << ") "
        << "not within Sequence with ID=" << pos1.getSeqID()
        << " which has length=" << seq1->getLength();
-    throw runtime_error(ss.str());
   }
-
-  if (pos2.getPos() < 0 || pos2.getPos() >= seq2->getLength())
+  else if (pos2.getPos() < 0 || pos2.getPos() >= seq2->getLength())
   {
-    stringstream ss;
     ss << "Invalid input join: " << join << ". Position of Side 2"
        << " (" << pos2.getPos() << ") "
        << "not within Sequence with ID=" << pos2.getSeqID()
        << " which has length=" << seq2->getLength();
+  }
+  return ss.str();
+}
+
+void SGClient::verifyAndMapJoins(JoinBatch& joins)
+{
+  // (if the server's ids are the side graph's, there's nothing to map)
+  bool identity = _seqIDs.isIdentity();
+  vector<sg_int_t> seqIDs[2];
+  if (!identity)
+  {
+    seqIDs[0].resize(joins.size());
+    seqIDs[1].resize(joins.size());
+  }
+  vector<sg_int_t>* outSeqIDs = identity ? NULL : seqIDs;
+  vector<size_t> bad;
+
+  int threads = _parsePool.getThreads();
+  if (threads == 0 || joins.size() < MinParallelJoins)
+  {
+    verifyAndMapJoins(joins, 0, joins.size(), outSeqIDs, bad);
+  }
+  else
+  {
+    // (each chunk only writes its own range of seqIDs)
+    vector<vector<size_t> > chunkBad(threads);
+    vector<future<void> > chunks;
+    size_t chunkSize = (joins.size() + threads - 1) / threads;
+    for (int i = 0; i < threads; ++i)
+    {
+      size_t begin = min(joins.size(), i * chunkSize);
+      size_t end = min(joins.size(), begin + chunkSize);
+      chunks.push_back(_parsePool.submit([&, i, begin, end](int) {
+            verifyAndMapJoins(joins, begin, end, outSeqIDs, chunkBad[i]);
+          }));
+    }
+    // (wait for them all before anything can throw)
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+      chunks[i].wait();
+    }
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+      chunks[i].get();
+      bad.insert(bad.end(), chunkBad[i].begin(), chunkBad[i].end());
+    }
+  }
+
+  if (bad.size() == 1)
+  {
+    throw runtime_error(getJoinError(joins.getJoin(bad[0])));
+  }
+  else if (!bad.empty())
+  {
+    stringstream ss;
+    ss << bad.size() << " invalid input joins:";
+    for (size_t i = 0; i < bad.size() && i < MaxJoinErrors; ++i)
+    {
+      ss << "\n" << getJoinError(joins.getJoin(bad[i]));
+    }
+    if (bad.size() > MaxJoinErrors)
+    {
+      ss << "\n(and " << bad.size() - MaxJoinErrors << " more)";
+    }
     throw runtime_error(ss.str());
   }
+
+  if (!identity)
+  {
+    joins.seqIDs[0].swap(seqIDs[0]);
+    joins.seqIDs[1].swap(seqIDs[1]);
+  }
+}
+
+void SGClient::verifyAndMapJoins(const JoinBatch& joins, size_t begin,
+                                 size_t end, vector<sg_int_t>* outSeqIDs,
+                                 vector<size_t>& outBad) const
+{
+  for (size_t i = begin; i < end; ++i)
+  {
+    bool valid = true;
+    for (int side = 0; side < 2; ++side)
+    {
+      sg_int_t sgID = getSGSeqID(joins.seqIDs[side][i]);
+      sg_int_t pos = joins.positions[side][i];
+      valid = valid && sgID >= 0 && pos >= 0 && pos < _seqLengths[sgID];
+      if (outSeqIDs != NULL)
+      {
+        outSeqIDs[side][i] = sgID;
+      }
+    }
+    if (!valid)
+    {
+      outBad.push_back(i);
+    }
+  }
 }
 
 void SGClient::verifyInPath(int alleleID, const vector<SGSegment>& path) const
 {
+  sg_int_t prevSGID = -1;
   for (int i = 0; i < path.size(); ++i)
   {
     const SGSegment& seg = path[i];
@@ -519,10 +1384,10 @@ void SGClient::verifyInPath(int alleleID, const vector<SGSegment>& path) const
       throw runtime_error(ss.str());
     }
     
-    const SGSequence* seq = _sg->getSequence(sgid);
+    sg_int_t length = _seqLengths[sgid];
 
     if (seg.getMinPos().getPos() < 0 ||
-        seg.getMaxPos().getPos() >= seq->getLength())
+        seg.getMaxPos().getPos() >= length)
     {
       stringstream ss;
       ss << "Segment " << i << " of allele path " << alleleID
@@ -530,7 +1395,7 @@ void SGClient::verifyInPath(int alleleID, const vector<SGSegment>& path) const
          << seg.getOutSide().getBase().getPos() << ", inclusive."
          << " This range is invalid as it spans bases not in "
          << "sequence with ID=" << pos.getSeqID() << " and length="
-         << seq->getLength();
+         << length;
       throw runtime_error(ss.str());      
     }
 
@@ -539,9 +1404,13 @@ void SGClient::verifyInPath(int alleleID, const vector<SGSegment>& path) const
       const SGSegment& prev = path[i - 1];
       const SGSide& fromSide = prev.getOutSide();
       const SGSide& toSide = seg.getInSide();
-      SGJoin join(fromSide, toSide);
-      mapSeqIDsInJoin(join);
-      if (!join.isTrivial() && _sg->getJoin(&join) == NULL)
+      // (mapping ids doesn't change whether a join is trivial)
+      if (!SGJoin(fromSide, toSide).isTrivial() &&
+          !_joinIndex.contains(
+            SGSide(SGPosition(prevSGID, fromSide.getBase().getPos()),
+                   fromSide.getForward()),
+            SGSide(SGPosition(sgid, toSide.getBase().getPos()),
+                   toSide.getForward())))
       {
         stringstream ss;
         ss << "Join, ["
@@ -573,7 +1442,63 @@ void SGClient::verifyInPath(int alleleID, const vector<SGSegment>& path) const
         throw runtime_error(ss.str());
       }
     }
+    prevSGID = sgid;
+  }
+}
+
+string SGClient::getPostOptions(PageType type, int pageToken,
+                                int pageSize) const
+{
+  switch (type)
+  {
+  case ReferencePage:
+    return getReferencePostOptions(pageToken, pageSize, -1, vector<int>(),
+                                   vector<string>(), vector<string>(),
+                                   vector<string>());
+  case SequencePage:
+    return getSequencePostOptions(pageToken, pageSize, -1, -1, true);
+  case JoinPage:
+    return getJoinPostOptions(pageToken, pageSize, -1, -1);
+  case AllelePage:
+    return getAllelePostOptions(pageToken, pageSize, -1, NULL, 0,
+                                numeric_limits<int>::max());
+  }
+  assert(false);
+  return string();
+}
+
+const char* SGClient::getSearchName(PageType type)
+{
+  switch (type)
+  {
+  case ReferencePage:
+    return "references";
+  case SequencePage:
+    return "sequences";
+  case JoinPage:
+    return "joins";
+  case AllelePage:
+    return "alleles";
+  }
+  assert(false);
+  return "";
+}
+
+const char* SGClient::getSearchPath(PageType type)
+{
+  switch (type)
+  {
+  case ReferencePage:
+    return "/references/search";
+  case SequencePage:
+    return "/sequences/search";
+  case JoinPage:
+    return "/joins/search";
+  case AllelePage:
+    return "/alleles/search";
   }
+  assert(false);
+  return "";
 }
 
 string SGClient::getSequencePostOptions(int pageToken,
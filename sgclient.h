@@ -11,12 +11,22 @@
 #include <vector>
 #include <limits>
 #include <map>
+#include <deque>
 #include <stdexcept>
+#include <exception>
+#include <atomic>
+#include <future>
+#include <memory>
 
 #include <sstream>
 #include "sidegraph.h"
 #include "sgsegment.h"
 #include "download.h"
+#include "runstats.h"
+#include "json2sg.h"
+#include "workerpool.h"
+#include "seqidmap.h"
+#include "joinindex.h"
 
 
 /** 
@@ -33,6 +43,11 @@ class SGClient
 public:
 
    static const int DefaultPageSize;
+   static const int DefaultFanout;
+   static const int MinAdaptivePageSize;
+   static const int MaxAdaptivePageSize;
+   static const double DefaultTargetSeconds;
+   static const size_t DefaultTargetBytes;
    
    SGClient();
    ~SGClient();
@@ -49,9 +64,90 @@ public:
    /** set the Page Size for POST requests */
    void setPageSize(int pageSize);
 
+   /** toggle adaptive page sizes: each search in downloadGraph() starts
+    * with the page size from setPageSize(), then resizes its pages after
+    * each one arrives so that a page takes about targetSeconds to 
+    * download and is about targetBytes big (whichever is smaller).
+    * With a cache, or when recording or replaying, targetSeconds is
+    * ignored so that the pages (which would otherwise depend on timing)
+    * are the same every run, and match the ones saved by earlier runs. */
+   void setAdaptivePageSize(bool adaptive,
+                            double targetSeconds = DefaultTargetSeconds,
+                            size_t targetBytes = DefaultTargetBytes);
+
    /** toggle whether paths are downloaded */
    void setSkipPaths(bool skipPaths);
 
+   /** set the maximum number of HTTP requests that can be run in 
+    * parallel */
+   void setConnections(int connections);
+
+   /** set the number of pages of each search that downloadGraph() 
+    * requests at once.  Since nextPageToken = pageToken + pageSize for 
+    * every full page, the tokens of the pages ahead can be guessed
+    * before the current page arrives.  1 means one page at a time. */
+   void setFanout(int fanout);
+
+   /** toggle pipelining: HTTP transfers are run in a background thread
+    * so that at least the next page of each search is downloading 
+    * while the current one is being parsed and added to the graph */
+   void setPipelined(bool pipelined);
+
+   /** set how many times a failed request is retried.  If a page of a 
+    * search still fails after that, downloadGraph() resumes the search
+    * from that page (up to the same number of times in a row) instead of
+    * starting over */
+   void setRetries(int retries);
+
+   /** give up on (and retry) requests that haven't received anything
+    * for given number of seconds (0, the default, never does) */
+   void setStallTimeout(int seconds);
+
+   /** keep a persistent cache of server responses in directory (using
+    * at most maxBytes of disk), so downloading the same graph again 
+    * doesn't need the network */
+   void setCacheDir(const std::string& directory,
+                    size_t maxBytes = ResponseCache::DefaultMaxBytes);
+
+   /** save every server response to an archive in directory, which 
+    * setReplayDir() can serve back later */
+   void setRecordDir(const std::string& directory);
+
+   /** don't use the server at all, but serve every request from an 
+    * archive made by setRecordDir().  Each request is made to take 
+    * latency seconds plus its size / bandwidth (in bytes per second,
+    * 0 for unlimited) */
+   void setReplayDir(const std::string& directory, double latency = 0.,
+                     double bandwidth = 0.);
+
+   /** toggle asking the server for gzip / deflate compressed responses
+    * (on by default) */
+   void setCompression(bool compression);
+
+   /** toggle parsing the pages of downloadGraph()'s searches as they
+    * download (on by default), instead of waiting for each one to 
+    * finish first */
+   void setStreaming(bool streaming);
+
+   /** set the number of threads that parse the pages of downloadGraph()'s
+    * searches (and the allele GETs), so that several are parsed at once.
+    * The pages are still added to the graph one at a time, in order,
+    * by the thread that called downloadGraph().  Pages are then parsed 
+    * once they've finished downloading, rather than streamed, and 
+    * transfers run in a background thread.  0 (the default) parses
+    * everything in the calling thread. */
+   void setParseThreads(int threads);
+
+   /** toggle upper-casing the bases of the sequences as they're 
+    * parsed (off by default).  They're checked either way. */
+   void setUpperCase(bool upperCase);
+
+   /** toggle downloading the References, Sequences, Joins and allele 
+    * paths searches at the same time in downloadGraph(), rather than 
+    * one after the other.  Everything is added to the graph once all 
+    * the downloads are done. */
+   void setConcurrentPhases(bool concurrentPhases);
+
    /** Download a whole Side Graph into memory.  Topolgy gets stored 
     * internally in (returned) SideGraph, path and bases get stored in 
     * the given vectors */
@@ -119,17 +215,229 @@ public:
    /** Add a mapping */
    void addSeqIDMapping(sg_int_t originalID, sg_int_t sgID);
    
+   /** Timings and counts of everything downloaded and parsed so far */
+   RunStats& getStats();
+
    /** Get access to Side Graph that's been downloaded so far */
    const SideGraph* getSideGraph() const;
    
 protected:
 
-   /** Make sure input join connects to positions that exist */
-   void verifyInJoin(const SGJoin& joine) const;
-
-   /** Make sure input segment spans range that exists */
+   /** Why input join doesn't connect positions that exist (empty if
+    * it does) */
+   std::string getJoinError(const SGJoin& join) const;
+
+   /** Make sure every join in the batch connects positions that exist,
+    * and map their sequence ids to the side graph's, looking each one
+    * up only once.  Big batches are split over the parse pool.  All
+    * the invalid joins are reported in one exception (which leaves
+    * joins as they were). */
+   void verifyAndMapJoins(JoinBatch& joins);
+   /** Do joins [begin, end) of the batch, writing the mapped ids of each
+    * side to outSeqIDs (unless it's NULL) and the indexes of invalid 
+    * joins to outBad */
+   void verifyAndMapJoins(const JoinBatch& joins, size_t begin, size_t end,
+                          std::vector<sg_int_t>* outSeqIDs,
+                          std::vector<size_t>& outBad) const;
+
+   // batches of joins smaller than this aren't worth splitting up
+   static const size_t MinParallelJoins;
+   // most invalid joins described in one error
+   static const size_t MaxJoinErrors;
+   // batches of allele paths with fewer segments than this aren't worth
+   // splitting up
+   static const size_t MinParallelSegments;
+
+   /** The different kinds of paged search requests we make */
+   enum PageType { ReferencePage, SequencePage, JoinPage, AllelePage };
+
+   struct ParsedPage;
+
+   /** Pages of one search that have been requested but not yet 
+    * processed, in page token order.  */
+   struct PageQueue {
+      struct Page {
+         int token;
+         // records we expect it to have
+         int stride;
+         Download::Request* request;
+         // when parsed by the pool: the parse, and what it found
+         std::shared_future<void> parsing;
+         std::shared_ptr<ParsedPage> parsed;
+      };
+      PageType type;
+      std::deque<Page> pages;
+      // token of next page to request
+      int nextToken;
+      // number of records we ask for in a page
+      int pageSize;
+      // most records the server will return in a page (-1 if unknown)
+      int serverCap;
+      bool finished;
+   };
+
+   /** Get ready to download all pages of a search, starting at pageToken */
+   void startPages(PageQueue& queue, PageType type, int pageToken);
+
+   /** Get the request for the next page in the queue, topping up the 
+    * queue with speculative requests beforehand.  */
+   Download::Request* nextPage(PageQueue& queue, int& outPageToken);
+
+   /** Done processing the page at the front of the queue, which said
+    * the next page starts at nextPageToken (-1 if it was the last).  If
+    * that's not what we guessed, the speculative requests are thrown 
+    * out and we start again from nextPageToken. */
+   void endPage(PageQueue& queue, int nextPageToken);
+
+   /** Cancel all requests in the queue */
+   void clearPages(PageQueue& queue);
+
+   /** Pick the size of the next pages of an adaptive search, given that
+    * the last one had records records, took seconds (-1 if unknown) and
+    * was bytes big */
+   void adaptPageSize(PageQueue& queue, int records, double seconds,
+                      size_t bytes);
+
+   /** An allele downloaded by GET, before it is validated and its 
+    * sequence ids are mapped to the side graph */
+   struct AlleleRecord {
+      int id;
+      // -1 if path not found
+      int ret;
+      // server response, kept only when path not found
+      std::string response;
+      // why the path didn't pass verifyInPath(), if it didn't
+      std::string error;
+      SGNamedPath path;
+      int variantSetID;
+   };
+
+   /** Everything downloaded by the paged searches of downloadGraph(),
+    * before it gets added to the side graph */
+   struct GraphPages {
+      std::map<int, std::string> refIDMap;
+      SequenceBatch sequences;
+      JoinBatch joins;
+      std::vector<AlleleRecord> alleles;
+   };
+
+   /** A page parsed by the pool, waiting its turn to go into GraphPages.
+    * For the allele search, that's just the ids of the alleles, which
+    * still need to be downloaded */
+   struct ParsedPage {
+      GraphPages pages;
+      std::vector<int> alleleIDs;
+      int nextPageToken;
+   };
+
+   /** Download and parse every page of the given search into pages */
+   void downloadPages(PageType type, GraphPages& pages);
+
+   /** Parse a page of the given search into pages, as it downloads if 
+    * streaming.  Alleles found by the allele search are put in 
+    * outAlleleIDs instead.  returns next page token */
+   int parsePage(PageType type, Download::Request* request, int pageToken,
+                 GraphPages& pages, std::vector<int>& outAlleleIDs);
+
+   /** Parse a page of the given search from response into pages (or
+    * outAlleleIDs).  returns next page token */
+   int parsePage(JSON2SG& parser, PageType type, ResponseStream& response,
+                 int pageToken, GraphPages& pages,
+                 std::vector<int>& outAlleleIDs);
+
+   /** Same as parsePage() for the page at the front of the queue, but
+    * with the parse pool, handing it every page in the queue that's 
+    * finished downloading */
+   int parsePooledPage(PageQueue& queue, GraphPages& pages,
+                       std::vector<int>& outAlleleIDs);
+
+   /** Start parsing a downloaded page in the pool */
+   void submitPage(PageType type, PageQueue::Page& page);
+
+   /** Run all the searches of downloadGraph() at the same time, each in
+    * its own thread */
+   void downloadPagesConcurrently(GraphPages& pages);
+
+   /** Thread body for downloadPagesConcurrently().  The first exception
+    * thrown is stored in error and cancels the other searches, as soon
+    * as they get to their next page (or allele) */
+   void downloadPagesInThread(PageType type, GraphPages* pages,
+                              std::exception_ptr* error);
+
+   /** Parse a page of sequences, appending them to outSequences (which
+    * is left alone on error).  returns next page token */
+   int parseSequencePage(JSON2SG& parser, ResponseStream& response,
+                         int pageToken,
+                         SequenceBatch& outSequences);
+
+   /** Name parsed sequences and add them to the side graph (sequences
+    * is cleared) */
+   void addSequences(SequenceBatch& sequences,
+                     std::vector<const SGSequence*>& outSequences,
+                     std::vector<std::string>* outBases,
+                     const std::map<int, std::string>* nameIdMap);
+
+   /** Parse a page of references into the id map. returns next page 
+    * token */
+   int parseReferencePage(JSON2SG& parser, ResponseStream& response,
+                          int pageToken,
+                          std::map<int, std::string>& outIdMap);
+
+   /** Parse a page of joins, appending them to outJoins (which is left
+    * alone on error).  returns next page token */
+   int parseJoinPage(JSON2SG& parser, ResponseStream& response,
+                     int pageToken,
+                     JoinBatch& outJoins);
+
+   /** Validate parsed joins and add them to the side graph (joins is 
+    * cleared).  Must be called after addSequences() */
+   void addJoins(JoinBatch& joins, std::vector<const SGJoin*>& outJoins);
+
+   /** Parse the allele ids out of a page of allele search results.
+    * returns next page token */
+   int parseAllelePage(JSON2SG& parser, ResponseStream& response,
+                       int pageToken, std::vector<int>& outAlleleIDs);
+
+   /** Download and parse the path of each allele, appending them to
+    * outAlleles (which is left alone on error) */
+   void downloadAlleles(const std::vector<int>& alleleIDs,
+                        std::vector<AlleleRecord>& outAlleles);
+
+   /** Validate downloaded alleles, adding the good paths to outPaths. Must
+    * be called after addJoins().  Big batches are checked in the parse
+    * pool. */
+   void addAllelePaths(std::vector<AlleleRecord>& alleles,
+                       std::vector<SGNamedPath>& outPaths);
+
+   /** Parse the result of an allele GET request */
+   void parseAllele(JSON2SG& parser, int alleleID, const char* result,
+                    AlleleRecord& outAllele);
+
+   /** Validate allele and map its path to side graph ids. returns false
+    * if path not found or invalid */
+   bool addAllelePath(AlleleRecord& allele);
+   /** The part of addAllelePath() that can run in any thread: validate
+    * the path and map it to side graph ids, or set allele.error */
+   void checkAllelePath(AlleleRecord& allele) const;
+
+   /** Build the URL for getting an allele */
+   std::string getAlleleURL(int alleleID) const;
+
+   /** Make sure input segment spans range that exists, and the joins
+    * between them do too */
    void verifyInPath(int alleleID, const std::vector<SGSegment>& path) const;
    
+   /** Build the POST options for a page of the given search, using the 
+    * default values for everything except pageToken and pageSize */
+   std::string getPostOptions(PageType type, int pageToken,
+                              int pageSize) const;
+
+   /** Path of the POST request for the given search */
+   static const char* getSearchPath(PageType type);
+
+   /** Name of the given search in the stats */
+   static const char* getSearchName(PageType type);
+   
    /** Build the JSON string for sequence download options */
    std::string getSequencePostOptions(int pageToken,
                                       int pageSize,
@@ -171,28 +479,45 @@ protected:
    Download _download;
    // sucky hack: to do: fix sidegraph and lookup to let sequences
    // have arbitrary ids.
-   std::map<sg_int_t, sg_int_t> _toOrigSeqId;
-   std::map<sg_int_t, sg_int_t> _fromOrigSeqId;
+   SeqIDMap _seqIDs;
+   // length of each sequence, by side graph id
+   std::vector<sg_int_t> _seqLengths;
+   // every join added to the side graph, for checking paths
+   JoinIndex _joinIndex;
    std::ostream* _os;
    std::stringstream _ignore;
    int _pageSize;
+   bool _adaptivePageSize;
+   double _targetSeconds;
+   size_t _targetBytes;
    bool _skipPaths;
+   int _fanout;
+   bool _pipelined;
+   bool _concurrentPhases;
+   bool _streaming;
+   bool _upperCase;
+   std::atomic<bool> _abortPages;
+   int _pageResumes;
+   std::atomic<size_t> _resumeCount;
+   RunStats _stats;
+   // a parser for each search, reused for all its pages (the searches
+   // can run in their own threads, so they can't share one)
+   JSON2SG _parsers[AllelePage + 1];
+   // parser for each thread of the parse pool
+   std::deque<JSON2SG> _poolParsers;
+   // (last, so its threads are stopped before anything they use is gone)
+   WorkerPool _parsePool;
 };
 
 inline sg_int_t SGClient::getOriginalSeqID(sg_int_t sgID) const
 {
-  assert(_toOrigSeqId.find(sgID) != _toOrigSeqId.end());
-  return _toOrigSeqId.find(sgID)->second;
+  assert(_seqIDs.getOriginal(sgID) != -1);
+  return _seqIDs.getOriginal(sgID);
 }
 
 inline sg_int_t SGClient::getSGSeqID(sg_int_t origID) const
 {
-  std::map<sg_int_t, sg_int_t>::const_iterator i =_fromOrigSeqId.find(origID);
-  if (i == _fromOrigSeqId.end())
-  {
-    return -1;
-  }
-  return i->second;
+  return _seqIDs.getSG(origID);
 }
 
 inline void SGClient::mapSeqIDsInJoin(SGJoin& join) const
@@ -222,8 +547,12 @@ inline void SGClient::mapSeqIDsInPath(std::vector<SGSegment>& path) const
 
 inline void SGClient::addSeqIDMapping(sg_int_t originalID, sg_int_t sgID)
 {
-  _toOrigSeqId.insert(std::pair<sg_int_t, sg_int_t>(sgID, originalID));
-  _fromOrigSeqId.insert(std::pair<sg_int_t, sg_int_t>(originalID, sgID));
+  _seqIDs.insert(originalID, sgID);
+}
+
+inline RunStats& SGClient::getStats()
+{
+  return _stats;
 }
 
 inline const SideGraph* SGClient::getSideGraph() const
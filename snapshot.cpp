@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+using namespace std;
+
+static const char Magic[8] = {'s', 'g', '2', 'v', 'g', 's', 'n', 'p'};
+// (reads back differently on a machine of the other byte order)
+static const uint32_t ByteOrder = 0x01020304;
+
+const uint32_t GraphSnapshot::Version = 1;
+
+/** Read only mapping of a whole file, unmapped when it goes out of
+ * scope */
+class MappedFile
+{
+public:
+   MappedFile(const string& path) : _data(NULL), _size(0)
+   {
+     int fd = open(path.c_str(), O_RDONLY);
+     struct stat info;
+     if (fd < 0 || fstat(fd, &info) != 0)
+     {
+       if (fd >= 0)
+       {
+         close(fd);
+       }
+       stringstream ss;
+       ss << "Unable to open snapshot " << path << ": " << strerror(errno);
+       throw runtime_error(ss.str());
+     }
+     _size = info.st_size;
+     if (_size > 0)
+     {
+       void* data = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+       _data = data == MAP_FAILED ? NULL : (const char*)data;
+     }
+     close(fd);
+     if (_size > 0 && _data == NULL)
+     {
+       stringstream ss;
+       ss << "Unable to map snapshot " << path << ": " << strerror(errno);
+       throw runtime_error(ss.str());
+     }
+   }
+   ~MappedFile()
+   {
+     if (_data != NULL)
+     {
+       munmap((void*)_data, _size);
+     }
+   }
+   const char* _data;
+   size_t _size;
+};
+
+void GraphSnapshot::save(const string& path, const SideGraph* sg,
+                         const vector<string>& bases,
+                         const vector<SGNamedPath>& paths,
+                         const vector<sg_int_t>& originalIDs)
+{
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, Magic, sizeof(Magic));
+  header.version = Version;
+  header.byteOrder = ByteOrder;
+  header.sequences = sg->getNumSequences();
+  header.joins = sg->getJoinSet()->size();
+  header.paths = paths.size();
+  for (size_t i = 0; i < paths.size(); ++i)
+  {
+    header.segments += paths[i].second.size();
+  }
+
+  // the strings go in the order they're referenced in the tables
+  vector<const string*> strings;
+  vector<Sequence> sequences(header.sequences);
+  for (sg_int_t i = 0; i < (sg_int_t)header.sequences; ++i)
+  {
+    const SGSequence* seq = sg->getSequence(i);
+    Sequence& out = sequences[i];
+    out.originalID = i < (sg_int_t)originalIDs.size() ? originalIDs[i] : i;
+    out.length = seq->getLength();
+    if (i >= (sg_int_t)bases.size() ||
+        (sg_int_t)bases[i].length() != out.length)
+    {
+      stringstream ss;
+      ss << "Can't save snapshot " << path << " without all "
+         << out.length << " bases of sequence " << i;
+      throw runtime_error(ss.str());
+    }
+    out.bases.offset = header.stringBytes;
+    out.bases.length = bases[i].length();
+    header.stringBytes += out.bases.length;
+    strings.push_back(&bases[i]);
+    out.name.offset = header.stringBytes;
+    out.name.length = seq->getName().length();
+    header.stringBytes += out.name.length;
+    strings.push_back(&seq->getName());
+  }
+
+  vector<Join> joins;
+  joins.reserve(header.joins);
+  const SideGraph::JoinSet* joinSet = sg->getJoinSet();
+  for (SideGraph::JoinSet::const_iterator i = joinSet->begin();
+       i != joinSet->end(); ++i)
+  {
+    Join join;
+    join.sides[0] = makeSide((*i)->getSide1());
+    join.sides[1] = makeSide((*i)->getSide2());
+    joins.push_back(join);
+  }
+
+  vector<Path> pathTable(header.paths);
+  vector<Segment> segments;
+  segments.reserve(header.segments);
+  for (size_t i = 0; i < paths.size(); ++i)
+  {
+    Path& out = pathTable[i];
+    out.name.offset = header.stringBytes;
+    out.name.length = paths[i].first.length();
+    header.stringBytes += out.name.length;
+    strings.push_back(&paths[i].first);
+    out.firstSegment = segments.size();
+    out.segments = paths[i].second.size();
+    for (size_t j = 0; j < paths[i].second.size(); ++j)
+    {
+      Segment segment;
+      segment.side = makeSide(paths[i].second[j].getSide());
+      segment.length = paths[i].second[j].getLength();
+      segments.push_back(segment);
+    }
+  }
+
+  string tempPath = path + ".tmp";
+  {
+    ofstream file(tempPath.c_str(), ios::out | ios::binary | ios::trunc);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)sequences.data(),
+               sequences.size() * sizeof(Sequence));
+    file.write((const char*)joins.data(), joins.size() * sizeof(Join));
+    file.write((const char*)pathTable.data(),
+               pathTable.size() * sizeof(Path));
+    file.write((const char*)segments.data(),
+               segments.size() * sizeof(Segment));
+    for (size_t i = 0; i < strings.size(); ++i)
+    {
+      file.write(strings[i]->data(), strings[i]->length());
+    }
+    file.close();
+    if (!file)
+    {
+      remove(tempPath.c_str());
+      stringstream ss;
+      ss << "Error writing snapshot " << tempPath;
+      throw runtime_error(ss.str());
+    }
+  }
+  if (rename(tempPath.c_str(), path.c_str()) != 0)
+  {
+    remove(tempPath.c_str());
+    stringstream ss;
+    ss << "Unable to rename " << tempPath << " to " << path << ": "
+       << strerror(errno);
+    throw runtime_error(ss.str());
+  }
+}
+
+SideGraph* GraphSnapshot::load(const string& path,
+                               vector<string>& outBases,
+                               vector<SGNamedPath>& outPaths,
+                               vector<sg_int_t>& outOriginalIDs)
+{
+  MappedFile file(path);
+  const char* data = file._data;
+  size_t size = file._size;
+
+  Header header;
+  if (size < sizeof(header))
+  {
+    throw runtime_error("Snapshot " + path + " is too short");
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, Magic, sizeof(Magic)) != 0 ||
+      header.byteOrder != ByteOrder || header.version != Version)
+  {
+    stringstream ss;
+    ss << path << " isn't a version " << Version << " snapshot written on "
+       << "a machine with the same byte order";
+    throw runtime_error(ss.str());
+  }
+
+  // check the tables fit (one at a time, so nothing can overflow)
+  size_t remaining = size - sizeof(header);
+  const uint64_t counts[4] = {header.sequences, header.joins, header.paths,
+                              header.segments};
+  const size_t recordSizes[4] = {sizeof(Sequence), sizeof(Join),
+                                 sizeof(Path), sizeof(Segment)};
+  for (int i = 0; i < 4; ++i)
+  {
+    if (counts[i] > remaining / recordSizes[i])
+    {
+      throw runtime_error("Snapshot " + path + " is truncated");
+    }
+    remaining -= counts[i] * recordSizes[i];
+  }
+  if (header.stringBytes != remaining)
+  {
+    throw runtime_error("Snapshot " + path + " is truncated");
+  }
+  const Sequence* sequences = (const Sequence*)(data + sizeof(header));
+  const Join* joins = (const Join*)(sequences + header.sequences);
+  const Path* paths = (const Path*)(joins + header.joins);
+  const Segment* segments = (const Segment*)(paths + header.paths);
+  const char* strings = (const char*)(segments + header.segments);
+
+  struct Checker {
+     const string& path;
+     const Header& header;
+     const Sequence* sequences;
+     void fail(const char* what) const
+     {
+       throw runtime_error("Snapshot " + path + " has an invalid " + what);
+     }
+     void check(const String& s) const
+     {
+       if (s.offset > header.stringBytes ||
+           s.length > header.stringBytes - s.offset)
+       {
+         fail("string");
+       }
+     }
+     void check(const Sequence& seq) const
+     {
+       check(seq.bases);
+       check(seq.name);
+       if (seq.length < 0 || (uint64_t)seq.length != seq.bases.length)
+       {
+         fail("sequence");
+       }
+     }
+     // (only once the sequences have been checked)
+     void check(const Side& side) const
+     {
+       if (side.seqID < 0 || side.seqID >= (int64_t)header.sequences ||
+           side.position < 0 ||
+           (side.position >> 1) >= sequences[side.seqID].length)
+       {
+         fail("side");
+       }
+     }
+     void check(const Segment& segment) const
+     {
+       check(segment.side);
+       int64_t pos = segment.side.position >> 1;
+       // (the room left from the side, in the segment's direction)
+       int64_t room = (segment.side.position & 1) != 0 ?
+          sequences[segment.side.seqID].length - pos : pos + 1;
+       if (segment.length <= 0 || segment.length > room)
+       {
+         fail("segment");
+       }
+     }
+  } checker = {path, header, sequences};
+
+  SideGraph* sg = new SideGraph();
+  try
+  {
+    outBases.resize(header.sequences);
+    outOriginalIDs.resize(header.sequences);
+    for (uint64_t i = 0; i < header.sequences; ++i)
+    {
+      const Sequence& seq = sequences[i];
+      checker.check(seq);
+      const SGSequence* added = sg->addSequence(
+        new SGSequence(i, seq.length,
+                       string(strings + seq.name.offset, seq.name.length)));
+      if (added->getID() != (sg_int_t)i)
+      {
+        checker.fail("sequence");
+      }
+      outBases[i].assign(strings + seq.bases.offset, seq.bases.length);
+      outOriginalIDs[i] = seq.originalID;
+    }
+
+    for (uint64_t i = 0; i < header.joins; ++i)
+    {
+      checker.check(joins[i].sides[0]);
+      checker.check(joins[i].sides[1]);
+      sg->addJoin(new SGJoin(getSide(joins[i].sides[0]),
+                             getSide(joins[i].sides[1])));
+    }
+
+    outPaths.resize(header.paths);
+    for (uint64_t i = 0; i < header.paths; ++i)
+    {
+      const Path& p = paths[i];
+      checker.check(p.name);
+      if (p.firstSegment > header.segments ||
+          p.segments > header.segments - p.firstSegment)
+      {
+        checker.fail("path");
+      }
+      outPaths[i].first.assign(strings + p.name.offset, p.name.length);
+      vector<SGSegment>& outPath = outPaths[i].second;
+      outPath.clear();
+      outPath.reserve(p.segments);
+      for (uint64_t j = p.firstSegment; j < p.firstSegment + p.segments; ++j)
+      {
+        checker.check(segments[j]);
+        outPath.push_back(SGSegment(getSide(segments[j].side),
+                                    segments[j].length));
+      }
+    }
+  }
+  catch (...)
+  {
+    delete sg;
+    throw;
+  }
+  return sg;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+#include "sidegraph.h"
+
+/**
+Binary snapshot of a downloaded graph (the side graph, the bases of
+each of its sequences, the allele paths and the server's id for each
+sequence), so that it can be converted again, with different options,
+without downloading it again.
+
+The file is a header, fixed size tables of sequences, joins, paths and
+path segments, then all the strings (bases and names) end to end:
+
+   Header         "sg2vgsnp", version, byte order, table sizes
+   Sequence[n]    server id, length, where its bases and name are
+   Join[n]        two sides, each a sequence id and 2 * position + forward
+   Path[n]        where its name is, its first segment and their number
+   Segment[n]     side (like a join's) and length
+   strings
+
+Everything is 64 bits and in the byte order of the machine that wrote
+it (which is checked on load), so loading just maps the file into
+memory and walks the tables.  Files are written to a temporary name
+then renamed, so a failed save never leaves half a snapshot.
+*/
+class GraphSnapshot
+{
+public:
+
+   /** Write a snapshot to path (throws runtime_error on failure).
+    * bases[i] must be all the bases of sequence i of sg, and 
+    * originalIDs[i] is the server's id for it */
+   static void save(const std::string& path, const SideGraph* sg,
+                    const std::vector<std::string>& bases,
+                    const std::vector<SGNamedPath>& paths,
+                    const std::vector<sg_int_t>& originalIDs);
+
+   /** Read a snapshot written by save() (throws runtime_error if it's
+    * missing, from another version or damaged).  returns the side graph,
+    * which the caller must delete */
+   static SideGraph* load(const std::string& path,
+                          std::vector<std::string>& outBases,
+                          std::vector<SGNamedPath>& outPaths,
+                          std::vector<sg_int_t>& outOriginalIDs);
+
+   static const uint32_t Version;
+
+protected:
+
+   struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t byteOrder;
+      uint64_t sequences;
+      uint64_t joins;
+      uint64_t paths;
+      uint64_t segments;
+      uint64_t stringBytes;
+   };
+
+   /** a string, as offset and length in the strings at the end */
+   struct String {
+      uint64_t offset;
+      uint64_t length;
+   };
+
+   struct Sequence {
+      int64_t originalID;
+      int64_t length;
+      String bases;
+      String name;
+   };
+
+   struct Side {
+      int64_t seqID;
+      // 2 * position + forward
+      int64_t position;
+   };
+
+   struct Join {
+      Side sides[2];
+   };
+
+   struct Path {
+      String name;
+      uint64_t firstSegment;
+      uint64_t segments;
+   };
+
+   struct Segment {
+      Side side;
+      int64_t length;
+   };
+
+   static Side makeSide(const SGSide& side);
+   static SGSide getSide(const Side& side);
+};
+
+inline GraphSnapshot::Side GraphSnapshot::makeSide(const SGSide& side)
+{
+  Side out;
+  out.seqID = side.getBase().getSeqID();
+  out.position = side.getBase().getPos() * 2 + side.getForward();
+  return out;
+}
+
+inline SGSide GraphSnapshot::getSide(const Side& side)
+{
+  return SGSide(SGPosition(side.seqID, side.position >> 1),
+                (side.position & 1) != 0);
+}
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+// Micro-benchmarks for the hot spots of a download.  These don't touch
+// the network.  Run with no arguments for default sizes.
+//
+// usage: benchmarks [pageMegabytes] [pages] [records]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <chrono>
+
+#include "download.h"
+#include "json2sg.h"
+#include "bases.h"
+#include "seqidmap.h"
+
+using namespace std;
+
+// curl hands over the body in chunks of at most CURL_MAX_WRITE_SIZE
+static const size_t ChunkSize = CURL_MAX_WRITE_SIZE;
+
+static double now()
+{
+  return chrono::duration<double>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// what WriteMemoryCallback used to do: realloc to exact size every chunk,
+// and start from a fresh buffer every request
+static void oldAppend(Download::MemoryStruct& mem, const char* data,
+                      size_t length)
+{
+  mem.memory = (char*)realloc(mem.memory, mem.size + length + 1);
+  memcpy(&(mem.memory[mem.size]), data, length);
+  mem.size += length;
+  mem.memory[mem.size] = '\0';
+}
+
+static size_t benchOldBuffer(const vector<char>& page, int pages)
+{
+  size_t checksum = 0;
+  for (int i = 0; i < pages; ++i)
+  {
+    Download::MemoryStruct mem;
+    mem.memory = (char*)malloc(1);
+    mem.size = 0;
+    mem.capacity = 1;
+    for (size_t pos = 0; pos < page.size(); pos += ChunkSize)
+    {
+      oldAppend(mem, &page[pos], min(ChunkSize, page.size() - pos));
+      // keep another allocation in the way, like the rest of the program
+      // would, so realloc can't always grow in place
+      free(malloc(64));
+    }
+    checksum += mem.memory[mem.size / 2];
+    free(mem.memory);
+  }
+  return checksum;
+}
+
+static size_t benchNewBuffer(const vector<char>& page, int pages,
+                             bool presize)
+{
+  size_t checksum = 0;
+  Download::MemoryStruct mem;
+  mem.memory = (char*)malloc(1);
+  mem.capacity = 1;
+  for (int i = 0; i < pages; ++i)
+  {
+    // buffer is reused, like Download does with its pool
+    mem.size = 0;
+    if (presize)
+    {
+      Download::reserveBuffer(mem, page.size() + 1);
+    }
+    for (size_t pos = 0; pos < page.size(); pos += ChunkSize)
+    {
+      Download::appendToBuffer(mem, &page[pos],
+                               min(ChunkSize, page.size() - pos));
+      free(malloc(64));
+    }
+    checksum += mem.memory[mem.size / 2];
+  }
+  free(mem.memory);
+  return checksum;
+}
+
+// what extractStringVal used to do for every number in a page
+template <typename T>
+static bool oldConvert(const char* str, size_t length, T& out)
+{
+  stringstream ss;
+  ss.write(str, length);
+  ss >> out;
+  return !ss.fail();
+}
+
+static string makeJoinPage(int joins)
+{
+  stringstream ss;
+  ss << "{\"joins\": [";
+  for (int i = 0; i < joins; ++i)
+  {
+    ss << (i > 0 ? ", " : "")
+       << "{\"side1\": {\"base\": {\"sequenceId\": \"" << i % 1000
+       << "\", \"position\": \"" << i * 37 % 100003
+       << "\"}, \"strand\": \"POS_STRAND\"}, "
+       << "\"side2\": {\"base\": {\"sequenceId\": \"" << (i + 1) % 1000
+       << "\", \"position\": \"" << i * 101 % 100003
+       << "\"}, \"strand\": \"NEG_STRAND\"}}";
+  }
+  ss << "], \"nextPageToken\": null}";
+  return ss.str();
+}
+
+static string makeAllele(int segments)
+{
+  stringstream ss;
+  ss << "{\"id\": \"7\", \"name\": \"a7\", \"variantSetId\": \"0\", "
+     << "\"path\": {\"segments\": [";
+  for (int i = 0; i < segments; ++i)
+  {
+    ss << (i > 0 ? ", " : "")
+       << "{\"start\": {\"base\": {\"sequenceId\": \"" << i % 1000
+       << "\", \"position\": \"" << i * 37 % 100003
+       << "\"}, \"strand\": \"POS_STRAND\"}, \"length\": \""
+       << 1 + i % 500 << "\"}";
+  }
+  ss << "]}}";
+  return ss.str();
+}
+
+// pull the integer strings out of a page, so the conversions can be timed
+// on their own
+static vector<string> getNumbers(const string& page)
+{
+  vector<string> numbers;
+  for (size_t i = page.find(": \""); i != string::npos;
+       i = page.find(": \"", i + 1))
+  {
+    size_t end = page.find('"', i + 3);
+    string value = page.substr(i + 3, end - i - 3);
+    if (value.find_first_not_of("0123456789") == string::npos)
+    {
+      numbers.push_back(value);
+    }
+  }
+  return numbers;
+}
+
+template <typename F>
+static double benchConvert(const vector<string>& numbers, int pages,
+                           F convert, sg_int_t& outSum)
+{
+  double start = now();
+  outSum = 0;
+  for (int i = 0; i < pages; ++i)
+  {
+    for (size_t j = 0; j < numbers.size(); ++j)
+    {
+      sg_int_t value;
+      if (convert(numbers[j].c_str(), numbers[j].length(), value) == false)
+      {
+        cerr << "Error: can't convert " << numbers[j] << endl;
+        exit(1);
+      }
+      outSum += value;
+    }
+  }
+  return now() - start;
+}
+
+static double benchJoinPage(const string& page, int pages)
+{
+  JSON2SG parser;
+  JoinBatch joins;
+  double start = now();
+  for (int i = 0; i < pages; ++i)
+  {
+    joins.clear();
+    int nextPageToken;
+    if (parser.parseJoins(page.c_str(), joins, nextPageToken) < 0)
+    {
+      cerr << "Error: can't parse join page" << endl;
+      exit(1);
+    }
+  }
+  return now() - start;
+}
+
+static double benchAllele(const string& allele, int pages)
+{
+  JSON2SG parser;
+  double start = now();
+  for (int i = 0; i < pages; ++i)
+  {
+    int id, variantSetID;
+    vector<SGSegment> path;
+    string name;
+    if (parser.parseAllele(allele.c_str(), id, path, variantSetID, name) < 0)
+    {
+      cerr << "Error: can't parse allele" << endl;
+      exit(1);
+    }
+  }
+  return now() - start;
+}
+
+static bool benchNumbers(int records, int pages)
+{
+  string joinPage = makeJoinPage(records);
+  string allele = makeAllele(records);
+  vector<string> numbers = getNumbers(joinPage);
+  vector<string> alleleNumbers = getNumbers(allele);
+  numbers.insert(numbers.end(), alleleNumbers.begin(), alleleNumbers.end());
+
+  cout << "Numeric fields: " << pages << " pages of " << records
+       << " joins and an allele of " << records << " segments ("
+       << numbers.size() << " numbers each)" << endl;
+
+  sg_int_t sum1, sum2;
+  double t1 = benchConvert(numbers, pages, oldConvert<sg_int_t>, sum1);
+  cout << "  stringstream:       " << t1 << "s ("
+       << numbers.size() * pages / t1 << " numbers/s)" << endl;
+  double t2 = benchConvert(numbers, pages,
+                           JSON2SG::convertString<sg_int_t>, sum2);
+  cout << "  convertString:      " << t2 << "s ("
+       << numbers.size() * pages / t2 << " numbers/s)" << endl;
+
+  double t3 = benchJoinPage(joinPage, pages);
+  cout << "  join page parse:    " << t3 << "s ("
+       << (double)records * pages / t3 << " joins/s)" << endl;
+  double t4 = benchAllele(allele, pages);
+  cout << "  allele parse:       " << t4 << "s ("
+       << (double)records * pages / t4 << " segments/s)" << endl;
+
+  return sum1 == sum2;
+}
+
+template <typename F>
+static double benchNormalize(const string& bases, int pages, F normalize,
+                             string& outBases)
+{
+  double start = now();
+  for (int i = 0; i < pages; ++i)
+  {
+    outBases = bases;
+    if (normalize(&outBases[0], outBases.size(), true) != outBases.size())
+    {
+      cerr << "Error: valid bases rejected" << endl;
+      exit(1);
+    }
+  }
+  return now() - start;
+}
+
+static bool benchBases(size_t megabytes, int pages)
+{
+  string bases(megabytes * 1024 * 1024, 'A');
+  const char* iupac = "ACGTURYSWKMBDHVNacgturyswkmbdhvn";
+  for (size_t i = 0; i < bases.size(); ++i)
+  {
+    bases[i] = iupac[(i * 7 + i / 5) % 32];
+  }
+
+  cout << "Bases: " << pages << " sequences of " << megabytes << "MB"
+       << endl;
+
+  // (the copy is timed too, as it is in the parser)
+  string out1, out2;
+  double t1 = benchNormalize(bases, pages, normalizeBasesScalar, out1);
+  cout << "  lookup table:       " << t1 << "s ("
+       << (double)bases.size() * pages / t1 / (1 << 20) << " MB/s)" << endl;
+  double t2 = benchNormalize(bases, pages, normalizeBases, out2);
+  cout << "  " << getBasesKernelName() << ":" 
+       << string(19 - strlen(getBasesKernelName()), ' ') << t2 << "s ("
+       << (double)bases.size() * pages / t2 / (1 << 20) << " MB/s)" << endl;
+
+  // every invalid character has to be found by both, wherever it is
+  bool same = out1 == out2;
+  for (int c = 0; c < 256 && same; ++c)
+  {
+    bool valid = strchr(iupac, c) != NULL && c != 0;
+    for (size_t pos = 0; pos < 70; pos += 23)
+    {
+      string test1(bases, 0, 70);
+      test1[pos] = (char)c;
+      string test2 = test1;
+      size_t expected = valid ? test1.size() : pos;
+      same = same && 
+         normalizeBasesScalar(&test1[0], test1.size(), true) == expected &&
+         normalizeBases(&test2[0], test2.size(), true) == expected;
+    }
+  }
+  return same;
+}
+
+template <typename F>
+static double benchLookups(const vector<sg_int_t>& joinIDs, F lookup,
+                           sg_int_t& outSum)
+{
+  double start = now();
+  outSum = 0;
+  for (size_t i = 0; i < joinIDs.size(); ++i)
+  {
+    outSum += lookup(joinIDs[i]);
+  }
+  return now() - start;
+}
+
+static bool benchSeqIDMap(int sequences, int joins, bool sparse)
+{
+  map<sg_int_t, sg_int_t> toOrig, fromOrig;
+  SeqIDMap seqIDs;
+  vector<sg_int_t> originalIDs(sequences);
+  for (int i = 0; i < sequences; ++i)
+  {
+    originalIDs[i] = sparse ? (sg_int_t)i * 1000003 + 17 : i;
+    toOrig.insert(pair<sg_int_t, sg_int_t>(i, originalIDs[i]));
+    fromOrig.insert(pair<sg_int_t, sg_int_t>(originalIDs[i], i));
+    seqIDs.insert(originalIDs[i], i);
+  }
+  // both sides of every join, scattered over the sequences
+  vector<sg_int_t> joinIDs(joins * 2);
+  for (size_t i = 0; i < joinIDs.size(); ++i)
+  {
+    joinIDs[i] = originalIDs[(i * 7919) % sequences];
+  }
+
+  cout << "Sequence ids: " << joins << " joins over " << sequences
+       << (sparse ? " sparse" : " compact") << " sequence ids" 
+       << (seqIDs.isDense() ? " (dense table)" : " (hash table)") << endl;
+
+  sg_int_t sum1, sum2, sum3, sum4;
+  double t1 = benchLookups(joinIDs, [&](sg_int_t id) {
+      return fromOrig.find(id)->second; }, sum1);
+  cout << "  std::map:           " << t1 << "s ("
+       << joinIDs.size() / t1 << " lookups/s)" << endl;
+  double t2 = benchLookups(joinIDs, [&](sg_int_t id) {
+      return seqIDs.getSG(id); }, sum2);
+  cout << "  SeqIDMap:           " << t2 << "s ("
+       << joinIDs.size() / t2 << " lookups/s)" << endl;
+
+  // (check the other direction gives the same answers too)
+  for (size_t i = 0; i < joinIDs.size(); ++i)
+  {
+    joinIDs[i] = seqIDs.getSG(joinIDs[i]);
+  }
+  benchLookups(joinIDs, [&](sg_int_t id) {
+      return toOrig.find(id)->second; }, sum3);
+  benchLookups(joinIDs, [&](sg_int_t id) {
+      return seqIDs.getOriginal(id); }, sum4);
+
+  return sum1 == sum2 && sum3 == sum4 && seqIDs.getSG(-1) == -1 &&
+     seqIDs.getSG(sparse ? 1 : sequences) == -1;
+}
+
+int main(int argc, char** argv)
+{
+  size_t pageMegabytes = argc > 1 ? atoi(argv[1]) : 32;
+  int pages = argc > 2 ? atoi(argv[2]) : 8;
+  int records = argc > 3 ? atoi(argv[3]) : 100000;
+
+  vector<char> page(pageMegabytes * 1024 * 1024);
+  for (size_t i = 0; i < page.size(); ++i)
+  {
+    page[i] = "ACGT"[i % 4];
+  }
+
+  cout << "Response buffers: " << pages << " pages of " << pageMegabytes
+       << "MB in " << ChunkSize << " byte chunks" << endl;
+
+  double start = now();
+  size_t c1 = benchOldBuffer(page, pages);
+  double t1 = now() - start;
+  cout << "  realloc every chunk:     " << t1 << "s" << endl;
+
+  start = now();
+  size_t c2 = benchNewBuffer(page, pages, false);
+  double t2 = now() - start;
+  cout << "  geometric growth, reuse: " << t2 << "s" << endl;
+
+  start = now();
+  size_t c3 = benchNewBuffer(page, pages, true);
+  double t3 = now() - start;
+  cout << "  pre-sized, reuse:        " << t3 << "s" << endl;
+
+  if (c1 != c2 || c1 != c3)
+  {
+    cerr << "Error: buffers don't match" << endl;
+    return 1;
+  }
+
+  if (benchNumbers(records, pages) == false)
+  {
+    cerr << "Error: conversions don't match" << endl;
+    return 1;
+  }
+
+  if (benchSeqIDMap(records, records * 10, false) == false ||
+      benchSeqIDMap(records, records * 10, true) == false)
+  {
+    cerr << "Error: sequence id lookups don't match" << endl;
+    return 1;
+  }
+
+  if (benchBases(pageMegabytes, pages) == false)
+  {
+    cerr << "Error: base normalizations don't match" << endl;
+    return 1;
+  }
+
+  return 0;
+}
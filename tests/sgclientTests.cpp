@@ -10,11 +10,275 @@
 #include <cmath>
 #include <cstdio>
 #include <sstream>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "unitTests.h"
 #include "sgclient.h"
+#include "snapshot.h"
+#include "joinindex.h"
+#include "sg2vgjson.h"
 
 using namespace std;
 
+/** SGClient that can make up an archive of server responses for a tiny 
+ * graph, so that the download can be tested with no server.  The 
+ * archive goes in a temporary directory that's removed (along with 
+ * everything else put in it) when the client is destroyed */
+class ReplayTestClient : public SGClient
+{
+public:
+   using SGClient::AlleleRecord;
+   using SGClient::verifyInPath;
+
+   ReplayTestClient(CuTest* testCase)
+   {
+     char dirTemplate[] = "/tmp/sg2vgTestXXXXXX";
+     CuAssertTrue(testCase, mkdtemp(dirTemplate) != NULL);
+     dir = dirTemplate;
+     setURL("http://localhost/v0.6");
+     writeArchive();
+   }
+
+   ~ReplayTestClient()
+   {
+     DIR* d = opendir(dir.c_str());
+     struct dirent* de;
+     while (d != NULL && (de = readdir(d)) != NULL)
+     {
+       if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+       {
+         remove((dir + "/" + de->d_name).c_str());
+       }
+     }
+     if (d != NULL)
+     {
+       closedir(d);
+     }
+     rmdir(dir.c_str());
+   }
+
+   /** number of files in dir */
+   int countFiles() const
+   {
+     int count = 0;
+     DIR* d = opendir(dir.c_str());
+     struct dirent* de;
+     while (d != NULL && (de = readdir(d)) != NULL)
+     {
+       count += de->d_name[0] != '.';
+     }
+     if (d != NULL)
+     {
+       closedir(d);
+     }
+     return count;
+   }
+
+   /** serve every request from the archive as it is now */
+   void replay()
+   {
+     setReplayDir(dir);
+   }
+
+   void writeArchive()
+   {
+     writePage(ReferencePage,
+               "{\"references\": [{\"name\": \"chr1\", "
+               "\"sequenceId\": \"5\"}], \"nextPageToken\": null}");
+     writePage(SequencePage,
+               "{\"sequences\": [{\"id\": \"5\", \"length\": \"4\", "
+               "\"bases\": \"ACGT\"}, {\"id\": \"9\", \"length\": \"2\", "
+               "\"bases\": \"TT\"}], \"nextPageToken\": null}");
+     writePage(JoinPage,
+               "{\"joins\": [{\"side1\": {\"base\": {\"sequenceId\": \"5\", "
+               "\"position\": \"3\"}, \"strand\": \"POS_STRAND\"}, "
+               "\"side2\": {\"base\": {\"sequenceId\": \"9\", "
+               "\"position\": \"0\"}, \"strand\": \"NEG_STRAND\"}}], "
+               "\"nextPageToken\": null}");
+     writePage(AllelePage,
+               "{\"alleles\": [{\"id\": \"7\"}], \"nextPageToken\": null}");
+     writeResponse(getAlleleURL(7), "",
+                   "{\"id\": \"7\", \"name\": \"a7\", \"variantSetId\": \"0\", "
+                   "\"path\": {\"segments\": [{\"start\": {\"base\": "
+                   "{\"sequenceId\": \"5\", \"position\": \"0\"}, "
+                   "\"strand\": \"POS_STRAND\"}, \"length\": \"4\"}, "
+                   "{\"start\": {\"base\": {\"sequenceId\": \"9\", "
+                   "\"position\": \"0\"}, \"strand\": \"POS_STRAND\"}, "
+                   "\"length\": \"2\"}]}}");
+   }
+
+   /** GET responses for alleles [0, n), each a path over sequence 5 */
+   void writeAlleles(int n)
+   {
+     for (int i = 0; i < n; ++i)
+     {
+       stringstream ss;
+       ss << "{\"id\": \"" << i << "\", \"name\": \"a" << i << "\", "
+          << "\"variantSetId\": \"0\", \"path\": {\"segments\": "
+          << "[{\"start\": {\"base\": {\"sequenceId\": \"5\", "
+          << "\"position\": \"0\"}, \"strand\": \"POS_STRAND\"}, "
+          << "\"length\": \"4\"}]}}";
+       writeResponse(getAlleleURL(i), "", ss.str());
+     }
+   }
+
+   /** downloadAlleles() with the parse pool held up for a while first,
+    * so the GETs all finish well before their parses */
+   void downloadSlowAlleles(const vector<int>& alleleIDs,
+                            vector<AlleleRecord>& outAlleles)
+   {
+     _parsePool.submit([](int worker) { usleep(200000); });
+     downloadAlleles(alleleIDs, outAlleles);
+   }
+
+   /** replace the archive's sequence page */
+   void writeSequences(const string& response)
+   {
+     writePage(SequencePage, response);
+   }
+
+   void writePage(PageType type, const string& response)
+   {
+     writeResponse(_url + getSearchPath(type),
+                   getPostOptions(type, 0, _pageSize), response);
+   }
+
+   void writeResponse(const string& url, const string& postData,
+                      const string& response)
+   {
+     string path = dir + "/" + ResponseCache::getKey(url, postData);
+     ResponseCache::writeEntry(path, url, postData, response.c_str(),
+                               response.length(), 200);
+   }
+
+   size_t getResumeCount() const
+   {
+     return _resumeCount;
+   }
+
+   string dir;
+};
+
+/** Bare bones HTTP server on a local port, in its own thread, that 
+ * answers each search with a page of a graph of n sequences (with no
+ * references, joins or alleles), for whatever pageToken and pageSize 
+ * were asked for.  One request per connection. */
+class TestServer
+{
+public:
+   TestServer(int sequences) : _sequences(sequences)
+   {
+     _socket = socket(AF_INET, SOCK_STREAM, 0);
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+     socklen_t length = sizeof(addr);
+     if (_socket < 0 || bind(_socket, (struct sockaddr*)&addr, length) != 0 ||
+         listen(_socket, 64) != 0 ||
+         getsockname(_socket, (struct sockaddr*)&addr, &length) != 0)
+     {
+       throw runtime_error("Unable to start test server");
+     }
+     stringstream ss;
+     ss << "http://127.0.0.1:" << ntohs(addr.sin_port) << "/v0.6";
+     url = ss.str();
+     _thread = thread(&TestServer::serve, this);
+   }
+
+   ~TestServer()
+   {
+     // (wakes up accept())
+     shutdown(_socket, SHUT_RDWR);
+     _thread.join();
+     close(_socket);
+   }
+
+   string url;
+
+protected:
+
+   void serve()
+   {
+     int connection;
+     while ((connection = accept(_socket, NULL, NULL)) >= 0)
+     {
+       answer(connection);
+       close(connection);
+     }
+   }
+
+   void answer(int connection)
+   {
+     string request;
+     size_t headerEnd;
+     char buffer[4096];
+     while ((headerEnd = request.find("\r\n\r\n")) == string::npos ||
+            request.length() < headerEnd + 4 + getValue(request,
+                                                        "Content-Length: "))
+     {
+       ssize_t bytes = recv(connection, buffer, sizeof(buffer), 0);
+       if (bytes <= 0)
+       {
+         return;
+       }
+       request.append(buffer, bytes);
+     }
+     string body = request.substr(headerEnd + 4);
+     int pageToken = getValue(body, "\"pageToken\":\"");
+     int pageSize = getValue(body, "\"pageSize\":");
+
+     stringstream page;
+     if (request.find("/sequences/search") == string::npos)
+     {
+       string kind = request.substr(request.find("/v0.6/") + 6);
+       kind = kind.substr(0, kind.find('/'));
+       page << "{\"" << kind << "\": [], \"nextPageToken\": null}";
+     }
+     else
+     {
+       int end = min(pageToken + pageSize, _sequences);
+       page << "{\"sequences\": [";
+       for (int i = pageToken; i < end; ++i)
+       {
+         page << (i > pageToken ? ", " : "") << "{\"id\": \"" << i
+              << "\", \"length\": \"50\", \"bases\": \""
+              << string(50, "ACGT"[i % 4]) << "\"}";
+       }
+       page << "], \"nextPageToken\": ";
+       if (end < _sequences)
+       {
+         page << "\"" << end << "\"}";
+       }
+       else
+       {
+         page << "null}";
+       }
+     }
+     stringstream response;
+     response << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+              << "Content-Length: " << page.str().length() << "\r\n"
+              << "Connection: close\r\n\r\n" << page.str();
+     send(connection, response.str().data(), response.str().length(), 0);
+   }
+
+   /** the number after key in text (0 if it's not there) */
+   static int getValue(const string& text, const string& key)
+   {
+     size_t i = text.find(key);
+     return i == string::npos ? 0 : atoi(text.c_str() + i + key.length());
+   }
+
+   int _sequences;
+   int _socket;
+   thread _thread;
+};
+
 
 ///////////////////////////////////////////////////////////
 //  
@@ -25,9 +289,392 @@ void dummyTest(CuTest *testCase)
   CuAssertTrue(testCase, true);
 }
 
+///////////////////////////////////////////////////////////
+//  Download and check a whole (tiny) graph from a replayed 
+//  archive.  
+///////////////////////////////////////////////////////////
+void replayTest(CuTest *testCase)
+{
+  ReplayTestClient client(testCase);
+  client.replay();
+  
+  vector<string> bases;
+  vector<SGNamedPath> paths;
+  const SideGraph* sg = client.downloadGraph(bases, paths);
+
+  CuAssertIntEquals(testCase, 2, sg->getNumSequences());
+  CuAssertIntEquals(testCase, 1, sg->getJoinSet()->size());
+  CuAssertTrue(testCase, bases.size() == 2);
+  CuAssertTrue(testCase, bases[0] == "ACGT" && bases[1] == "TT");
+  CuAssertTrue(testCase, sg->getSequence(0)->getName() == "chr1");
+  CuAssertTrue(testCase, sg->getSequence(1)->getName() == "Seq9");
+  CuAssertIntEquals(testCase, 5, client.getOriginalSeqID(0));
+  CuAssertIntEquals(testCase, 9, client.getOriginalSeqID(1));
+  CuAssertIntEquals(testCase, 1, paths.size());
+  CuAssertTrue(testCase, paths[0].first == "a7");
+  CuAssertIntEquals(testCase, 2, paths[0].second.size());
+  CuAssertIntEquals(testCase, 1, paths[0].second[1].getSide().getBase().getSeqID());
+}
+
+///////////////////////////////////////////////////////////
+//  A page that downloads fine but has bad data in it must 
+//  fail straight away rather than be downloaded again.
+///////////////////////////////////////////////////////////
+void badPageTest(CuTest *testCase)
+{
+  ReplayTestClient client(testCase);
+  client.setRetries(1);
+  client.writeSequences("{\"sequences\": [{\"id\": \"5\", \"length\": "
+                        "\"4\", \"bases\": \"ACGJ\"}], "
+                        "\"nextPageToken\": null}");
+  client.replay();
+
+  vector<string> bases;
+  vector<SGNamedPath> paths;
+  string error;
+  try
+  {
+    client.downloadGraph(bases, paths);
+  }
+  catch (runtime_error& e)
+  {
+    error = e.what();
+  }
+  CuAssertTrue(testCase, error.find("invalid base") != string::npos);
+  CuAssertIntEquals(testCase, 0, client.getResumeCount());
+}
+
+///////////////////////////////////////////////////////////
+//  Download more alleles than fit in the request window 
+//  while their parses lag behind the GETs.
+///////////////////////////////////////////////////////////
+void slowAlleleParseTest(CuTest *testCase)
+{
+  ReplayTestClient client(testCase);
+  client.setConnections(1);
+  client.setParseThreads(1);
+  client.writeAlleles(10);
+  client.replay();
+
+  vector<int> alleleIDs;
+  for (int i = 0; i < 10; ++i)
+  {
+    alleleIDs.push_back(i);
+  }
+  vector<ReplayTestClient::AlleleRecord> alleles;
+  client.downloadSlowAlleles(alleleIDs, alleles);
+
+  CuAssertIntEquals(testCase, 10, alleles.size());
+  for (int i = 0; i < 10; ++i)
+  {
+    CuAssertIntEquals(testCase, i, alleles[i].id);
+    CuAssertIntEquals(testCase, 1, alleles[i].path.second.size());
+  }
+}
+
+///////////////////////////////////////////////////////////
+//  Record a download with adaptive page sizes, then replay 
+//  it with the same settings (but slower responses): the 
+//  replay must ask for exactly the pages that were recorded.
+///////////////////////////////////////////////////////////
+void adaptiveReplayTest(CuTest *testCase)
+{
+  TestServer server(500);
+  ReplayTestClient recorder(testCase);
+  recorder.setURL(server.url);
+  recorder.setPageSize(10);
+  recorder.setAdaptivePageSize(true, 0.01, 2000);
+  recorder.setRecordDir(recorder.dir);
+  vector<string> recordedBases;
+  vector<SGNamedPath> paths;
+  recorder.downloadGraph(recordedBases, paths);
+  CuAssertIntEquals(testCase, 500, recordedBases.size());
+  // (at a fixed page size, it would take 50 pages)
+  int archived = recorder.countFiles();
+  CuAssertTrue(testCase, archived < 40);
+
+  ReplayTestClient player(testCase);
+  player.setURL(server.url);
+  player.setPageSize(10);
+  player.setAdaptivePageSize(true, 0.01, 2000);
+  player.setRetries(0);
+  player.setReplayDir(recorder.dir, 0.05);
+  vector<string> bases;
+  string error;
+  try
+  {
+    player.downloadGraph(bases, paths);
+  }
+  catch (runtime_error& e)
+  {
+    error = e.what();
+  }
+  CuAssertStrEquals(testCase, "", error.c_str());
+  CuAssertTrue(testCase, bases == recordedBases);
+  CuAssertIntEquals(testCase, archived, recorder.countFiles());
+}
+
+///////////////////////////////////////////////////////////
+//  Server sequence ids are kept as VG node ids as long as 
+//  the converted graph has the same sequences, whatever 
+//  happened to the case of their bases.
+///////////////////////////////////////////////////////////
+static SideGraph* makeSequenceGraph(const vector<sg_int_t>& lengths)
+{
+  SideGraph* sg = new SideGraph();
+  for (size_t i = 0; i < lengths.size(); ++i)
+  {
+    stringstream name;
+    name << "seq" << i;
+    sg->addSequence(new SGSequence(i, lengths[i], name.str()));
+  }
+  return sg;
+}
+
+void serverNodeIDsTest(CuTest *testCase)
+{
+  vector<sg_int_t> lengths;
+  lengths.push_back(10);
+  lengths.push_back(20);
+  lengths.push_back(30);
+  vector<sg_int_t> originalIDs;
+  originalIDs.push_back(5);
+  originalIDs.push_back(7);
+  originalIDs.push_back(9);
+  SideGraph* sg = makeSequenceGraph(lengths);
+  vector<sg_int_t> nodeIDs;
+  string whyNot;
+
+  // the same sequences (with only their case changed, say)
+  SideGraph* same = makeSequenceGraph(lengths);
+  CuAssertTrue(testCase, SG2VGJSON::getServerNodeIDs(sg, originalIDs, same,
+                                                     nodeIDs, whyNot));
+  CuAssertTrue(testCase, nodeIDs == originalIDs);
+  delete same;
+
+  // a sequence cut in two
+  vector<sg_int_t> cutLengths = lengths;
+  cutLengths[1] = 5;
+  cutLengths.push_back(15);
+  SideGraph* cut = makeSequenceGraph(cutLengths);
+  CuAssertTrue(testCase, !SG2VGJSON::getServerNodeIDs(sg, originalIDs, cut,
+                                                      nodeIDs, whyNot));
+  CuAssertStrEquals(testCase, "1 more nodes than sequences (some had to be cut)", whyNot.c_str());
+  delete cut;
+
+  // the same number of sequences, but not the same ones
+  vector<sg_int_t> otherLengths = lengths;
+  swap(otherLengths[0], otherLengths[2]);
+  SideGraph* other = makeSequenceGraph(otherLengths);
+  CuAssertTrue(testCase, !SG2VGJSON::getServerNodeIDs(sg, originalIDs, other,
+                                                      nodeIDs, whyNot));
+  CuAssertStrEquals(testCase, "node 1 isn't sequence 0", whyNot.c_str());
+
+  // an id VG can't take
+  originalIDs[1] = 0;
+  CuAssertTrue(testCase, !SG2VGJSON::getServerNodeIDs(sg, originalIDs, sg,
+                                                      nodeIDs, whyNot));
+  CuAssertStrEquals(testCase, "0 isn't a valid VG node ID", whyNot.c_str());
+  delete other;
+  delete sg;
+}
+
+///////////////////////////////////////////////////////////
+//  A join can be added and found with its sides either way 
+//  round, and the index keeps everything as it grows.
+///////////////////////////////////////////////////////////
+void joinIndexTest(CuTest *testCase)
+{
+  JoinIndex index;
+  SGSide side1(SGPosition(3, 10), true);
+  SGSide side2(SGPosition(1, 4), false);
+  index.insert(side1, side2);
+  CuAssertTrue(testCase, index.contains(side1, side2));
+  CuAssertTrue(testCase, index.contains(side2, side1));
+  index.insert(side2, side1);
+  CuAssertIntEquals(testCase, 1, index.size());
+  // (the strand is part of the side)
+  CuAssertTrue(testCase, !index.contains(SGSide(SGPosition(3, 10), false),
+                                         side2));
+
+  // enough to rehash several times
+  for (sg_int_t i = 0; i < 1000; ++i)
+  {
+    index.insert(SGSide(SGPosition(i, i), true),
+                 SGSide(SGPosition(i + 1, 0), false));
+  }
+  CuAssertIntEquals(testCase, 1001, index.size());
+  for (sg_int_t i = 0; i < 1000; ++i)
+  {
+    CuAssertTrue(testCase, index.contains(
+                   SGSide(SGPosition(i + 1, 0), false),
+                   SGSide(SGPosition(i, i), true)));
+    CuAssertTrue(testCase, !index.contains(
+                   SGSide(SGPosition(i, i + 1), true),
+                   SGSide(SGPosition(i + 1, 0), false)));
+  }
+  CuAssertTrue(testCase, index.contains(side1, side2));
+
+  // negative ids are never in the index, and can't be added
+  SGSide negative(SGPosition(-1, 0), true);
+  CuAssertTrue(testCase, !index.contains(negative, side1));
+  CuAssertTrue(testCase, !index.contains(side1, negative));
+  bool threw = false;
+  try
+  {
+    index.insert(negative, side1);
+  }
+  catch (runtime_error& e)
+  {
+    threw = true;
+  }
+  CuAssertTrue(testCase, threw);
+  CuAssertIntEquals(testCase, 1001, index.size());
+}
+
+///////////////////////////////////////////////////////////
+//  Check allele paths against the joins of a downloaded 
+//  graph (in server ids).
+///////////////////////////////////////////////////////////
+void verifyInPathTest(CuTest *testCase)
+{
+  ReplayTestClient client(testCase);
+  client.replay();
+  vector<string> bases;
+  vector<SGNamedPath> paths;
+  client.downloadGraph(bases, paths);
+
+  // the archive's only join, traversed the other way
+  vector<SGSegment> path;
+  path.push_back(SGSegment(SGSide(SGPosition(9, 1), false), 2));
+  path.push_back(SGSegment(SGSide(SGPosition(5, 3), false), 4));
+  client.verifyInPath(7, path);
+
+  // (from one base short of the join)
+  path.clear();
+  path.push_back(SGSegment(SGSide(SGPosition(5, 0), true), 3));
+  path.push_back(SGSegment(SGSide(SGPosition(9, 0), true), 2));
+  string error;
+  try
+  {
+    client.verifyInPath(7, path);
+  }
+  catch (runtime_error& e)
+  {
+    error = e.what();
+  }
+  CuAssertStrEquals(testCase, 
+                    "Join, [ (Seq:5, Pos:2, POS_STRAND) ->  (Seq:9, Pos:0, "
+                    "NEG_STRAND) ], implied by segment 0 = [ Seq:5, Pos:0, "
+                    "Len:3, POS_STRAND ] and segment 1 = [ Seq:9, Pos:0, "
+                    "Len:2, POS_STRAND ] of allele path 7 not found in input "
+                    "graph", error.c_str());
+}
+
+///////////////////////////////////////////////////////////
+//  Save a downloaded graph to a snapshot and check that it 
+//  loads back the same.
+///////////////////////////////////////////////////////////
+void snapshotTest(CuTest *testCase)
+{
+  ReplayTestClient client(testCase);
+  client.replay();
+  
+  vector<string> bases;
+  vector<SGNamedPath> paths;
+  const SideGraph* sg = client.downloadGraph(bases, paths);
+  vector<sg_int_t> originalIDs;
+  originalIDs.push_back(client.getOriginalSeqID(0));
+  originalIDs.push_back(client.getOriginalSeqID(1));
+
+  string path = client.dir + "/graph.snap";
+  GraphSnapshot::save(path, sg, bases, paths, originalIDs);
+
+  vector<string> loadedBases;
+  vector<SGNamedPath> loadedPaths;
+  vector<sg_int_t> loadedIDs;
+  SideGraph* loaded = GraphSnapshot::load(path, loadedBases, loadedPaths,
+                                          loadedIDs);
+
+  CuAssertIntEquals(testCase, 2, loaded->getNumSequences());
+  for (sg_int_t i = 0; i < 2; ++i)
+  {
+    CuAssertTrue(testCase, loaded->getSequence(i)->getName() ==
+                 sg->getSequence(i)->getName());
+    CuAssertIntEquals(testCase, sg->getSequence(i)->getLength(),
+                      loaded->getSequence(i)->getLength());
+  }
+  CuAssertIntEquals(testCase, 1, loaded->getJoinSet()->size());
+  const SGJoin* join = *sg->getJoinSet()->begin();
+  CuAssertTrue(testCase, loaded->getJoin(join) != NULL);
+  CuAssertTrue(testCase, loadedBases == bases);
+  CuAssertTrue(testCase, loadedIDs == originalIDs);
+  CuAssertIntEquals(testCase, 1, loadedPaths.size());
+  CuAssertTrue(testCase, loadedPaths[0].first == "a7");
+  CuAssertIntEquals(testCase, 2, loadedPaths[0].second.size());
+  for (int i = 0; i < 2; ++i)
+  {
+    const SGSegment& a = paths[0].second[i];
+    const SGSegment& b = loadedPaths[0].second[i];
+    CuAssertTrue(testCase, a.getSide() == b.getSide() &&
+                 a.getLength() == b.getLength());
+  }
+  delete loaded;
+
+  // a path that runs off the end of its sequence must fail to load
+  vector<SGNamedPath> badPaths = paths;
+  badPaths[0].second[1].setLength(3);
+  GraphSnapshot::save(path, sg, bases, badPaths, originalIDs);
+  bool threw = false;
+  try
+  {
+    delete GraphSnapshot::load(path, loadedBases, loadedPaths, loadedIDs);
+  }
+  catch (runtime_error& e)
+  {
+    threw = true;
+  }
+  CuAssertTrue(testCase, threw);
+
+  // and there's no saving without the bases
+  vector<string> badBases = bases;
+  badBases[1].clear();
+  threw = false;
+  try
+  {
+    GraphSnapshot::save(path, sg, badBases, paths, originalIDs);
+  }
+  catch (runtime_error& e)
+  {
+    threw = true;
+  }
+  CuAssertTrue(testCase, threw);
+
+  // a truncated snapshot must fail to load, not crash
+  CuAssertIntEquals(testCase, 0, truncate(path.c_str(), 100));
+  threw = false;
+  try
+  {
+    delete GraphSnapshot::load(path, loadedBases, loadedPaths, loadedIDs);
+  }
+  catch (runtime_error& e)
+  {
+    threw = true;
+  }
+  CuAssertTrue(testCase, threw);
+}
+
 CuSuite* sgClientTestSuite(void) 
 {
   CuSuite* suite = CuSuiteNew();
   SUITE_ADD_TEST(suite, dummyTest);
+  SUITE_ADD_TEST(suite, replayTest);
+  SUITE_ADD_TEST(suite, badPageTest);
+  SUITE_ADD_TEST(suite, slowAlleleParseTest);
+  SUITE_ADD_TEST(suite, adaptiveReplayTest);
+  SUITE_ADD_TEST(suite, serverNodeIDsTest);
+  SUITE_ADD_TEST(suite, joinIndexTest);
+  SUITE_ADD_TEST(suite, verifyInPathTest);
+  SUITE_ADD_TEST(suite, snapshotTest);
   return suite;
 }
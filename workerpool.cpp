@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#include "workerpool.h"
+
+using namespace std;
+
+WorkerPool::WorkerPool() : _stopping(false)
+{
+
+}
+
+WorkerPool::~WorkerPool()
+{
+  stop();
+}
+
+void WorkerPool::start(int threads)
+{
+  stop();
+  _stopping = false;
+  for (int i = 0; i < threads; ++i)
+  {
+    _threads.push_back(thread(&WorkerPool::work, this, i));
+  }
+}
+
+void WorkerPool::stop()
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _ready.notify_all();
+  for (size_t i = 0; i < _threads.size(); ++i)
+  {
+    _threads[i].join();
+  }
+  _threads.clear();
+}
+
+future<void> WorkerPool::submit(const function<void(int)>& task)
+{
+  shared_ptr<Task> job(new Task(task));
+  future<void> result = job->get_future();
+  if (_threads.empty())
+  {
+    (*job)(0);
+    return result;
+  }
+  {
+    lock_guard<mutex> lock(_mutex);
+    _tasks.push_back(job);
+  }
+  _ready.notify_one();
+  return result;
+}
+
+void WorkerPool::work(int worker)
+{
+  while (true)
+  {
+    shared_ptr<Task> job;
+    {
+      unique_lock<mutex> lock(_mutex);
+      while (_tasks.empty() && !_stopping)
+      {
+        _ready.wait(lock);
+      }
+      if (_tasks.empty())
+      {
+        // (stopping, and nothing left to do)
+        return;
+      }
+      job = _tasks.front();
+      _tasks.pop_front();
+    }
+    (*job)(worker);
+  }
+}
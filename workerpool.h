@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2015 by Glenn Hickey (hickey@soe.ucsc.edu)
+ *
+ * Released under the MIT license, see LICENSE.cactus
+ */
+
+#ifndef _WORKERPOOL_H
+#define _WORKERPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+
+
+/**
+Fixed set of threads that run tasks in the order they're submitted.
+Each task is given the index of the worker running it, so that it can
+use state (like a parser) that belongs to that worker and doesn't need
+to be locked.  Anything a task throws comes back out of its future.
+
+With no threads, tasks just run in the thread that submits them.
+
+Thread safe.
+*/
+class WorkerPool
+{
+public:
+
+   WorkerPool();
+   ~WorkerPool();
+
+   /** Start the given number of worker threads (stopping any that are
+    * already running first) */
+   void start(int threads);
+
+   /** Finish all submitted tasks, then stop the worker threads */
+   void stop();
+
+   int getThreads() const;
+
+   /** Run task(worker) on one of the workers, where worker is in
+    * [0, getThreads()) */
+   std::future<void> submit(const std::function<void(int)>& task);
+
+protected:
+
+   typedef std::packaged_task<void(int)> Task;
+
+   /** Worker thread body */
+   void work(int worker);
+
+   std::vector<std::thread> _threads;
+   std::deque<std::shared_ptr<Task> > _tasks;
+   bool _stopping;
+   std::mutex _mutex;
+   std::condition_variable _ready;
+};
+
+inline int WorkerPool::getThreads() const
+{
+  return _threads.size();
+}
+
+#endif